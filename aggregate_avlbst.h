@@ -0,0 +1,303 @@
+#ifndef AGGREGATE_AVLBST_H
+#define AGGREGATE_AVLBST_H
+
+#include <cstddef>
+#include <limits>
+#include "avlbst.h"
+
+/**
+* Aggregate policies for AggregateAVLTree. A policy describes an associative operation over
+* the values of a key range:
+*   value_type                 the type of a summary
+*   identity()                 the summary of an empty range
+*   lift(key, value)           the summary of a single entry
+*   combine(left, right)       the summary of two adjacent ranges, left one first
+* combine() only has to be associative, not commutative, since entries are always combined
+* in key order.
+*/
+template <typename T>
+struct SumAggregate
+{
+    typedef T value_type;
+    static T identity() { return T(); }
+    template <typename Key> static T lift(const Key&, const T& value) { return value; }
+    static T combine(const T& left, const T& right) { return left + right; }
+};
+
+template <typename T>
+struct MinAggregate
+{
+    typedef T value_type;
+    static T identity() { return std::numeric_limits<T>::max(); }
+    template <typename Key> static T lift(const Key&, const T& value) { return value; }
+    static T combine(const T& left, const T& right) { return right < left ? right : left; }
+};
+
+template <typename T>
+struct MaxAggregate
+{
+    typedef T value_type;
+    static T identity() { return std::numeric_limits<T>::lowest(); }
+    template <typename Key> static T lift(const Key&, const T& value) { return value; }
+    static T combine(const T& left, const T& right) { return left < right ? right : left; }
+};
+
+struct CountAggregate
+{
+    typedef size_t value_type;
+    static size_t identity() { return 0; }
+    template <typename Key, typename Value> static size_t lift(const Key&, const Value&) { return 1; }
+    static size_t combine(size_t left, size_t right) { return left + right; }
+};
+
+/**
+* An AVL node that also stores the summary of its whole subtree.
+*/
+template <typename Key, typename Value, typename Aggregate>
+class AggregateAVLNode : public AVLNode<Key, Value>
+{
+public:
+    typedef typename Aggregate::value_type Summary;
+
+    AggregateAVLNode(const Key& key, const Value& value, AggregateAVLNode<Key, Value, Aggregate>* parent);
+    AggregateAVLNode(AggregateAVLNode<Key, Value, Aggregate>&& other);
+    virtual ~AggregateAVLNode();
+
+    // Getter/setter for the subtree summary
+    const Summary& getSummary() const;
+    void setSummary(const Summary& summary);
+
+    // Same reason as in AVLNode, these return the more specific node type
+    virtual AggregateAVLNode<Key, Value, Aggregate>* getParent() const override;
+    virtual AggregateAVLNode<Key, Value, Aggregate>* getLeft() const override;
+    virtual AggregateAVLNode<Key, Value, Aggregate>* getRight() const override;
+
+protected:
+    Summary summary_;
+};
+
+/*
+  -------------------------------------------------------
+  Begin implementations for the AggregateAVLNode class.
+  -------------------------------------------------------
+*/
+
+/**
+* A new node is a leaf, so its summary is just its own entry.
+*/
+template<class Key, class Value, class Aggregate>
+AggregateAVLNode<Key, Value, Aggregate>::AggregateAVLNode(const Key& key, const Value& value, AggregateAVLNode<Key, Value, Aggregate>* parent) :
+    AVLNode<Key, Value>(key, value, parent), summary_(Aggregate::lift(key, value))
+{
+
+}
+
+// Moving a node leaves its subtree as it was, so the summary comes along unchanged
+template<class Key, class Value, class Aggregate>
+AggregateAVLNode<Key, Value, Aggregate>::AggregateAVLNode(AggregateAVLNode<Key, Value, Aggregate>&& other) :
+    AVLNode<Key, Value>(std::move(other)), summary_(other.summary_)
+{
+
+}
+
+template<class Key, class Value, class Aggregate>
+AggregateAVLNode<Key, Value, Aggregate>::~AggregateAVLNode()
+{
+
+}
+
+template<class Key, class Value, class Aggregate>
+const typename Aggregate::value_type& AggregateAVLNode<Key, Value, Aggregate>::getSummary() const
+{
+    return summary_;
+}
+
+template<class Key, class Value, class Aggregate>
+void AggregateAVLNode<Key, Value, Aggregate>::setSummary(const Summary& summary)
+{
+    summary_ = summary;
+}
+
+template<class Key, class Value, class Aggregate>
+AggregateAVLNode<Key, Value, Aggregate>* AggregateAVLNode<Key, Value, Aggregate>::getParent() const
+{
+    return static_cast<AggregateAVLNode<Key, Value, Aggregate>*>(this->parent_);
+}
+
+template<class Key, class Value, class Aggregate>
+AggregateAVLNode<Key, Value, Aggregate>* AggregateAVLNode<Key, Value, Aggregate>::getLeft() const
+{
+    return static_cast<AggregateAVLNode<Key, Value, Aggregate>*>(this->left_);
+}
+
+template<class Key, class Value, class Aggregate>
+AggregateAVLNode<Key, Value, Aggregate>* AggregateAVLNode<Key, Value, Aggregate>::getRight() const
+{
+    return static_cast<AggregateAVLNode<Key, Value, Aggregate>*>(this->right_);
+}
+
+/*
+  -----------------------------------------------------
+  End implementations for the AggregateAVLNode class.
+  -----------------------------------------------------
+*/
+
+/**
+* An AVL tree that keeps, in every node, the Aggregate summary of the values in its subtree.
+* Summaries are recomputed wherever heights are (rotations, insert/remove retracing, joins),
+* so a range reduction only needs the O(log n) nodes on the two boundary paths.
+* Values must be changed through insert(), not through an iterator, so summaries stay current.
+*/
+template <class Key, class Value, class Aggregate>
+class AggregateAVLTree : public AVLTree<Key, Value>
+{
+public:
+    typedef typename Aggregate::value_type Summary;
+    typedef AggregateAVLNode<Key, Value, Aggregate> ANode;
+
+    // The summary of every value with lo <= key <= hi, in O(log n)
+    Summary aggregate(const Key& lo, const Key& hi) const;
+    // The summary of the whole tree, in O(1)
+    Summary aggregate() const;
+
+protected:
+    virtual AVLNode<Key, Value>* createNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent) override;
+    virtual void valueUpdated(AVLNode<Key, Value>* node) override;
+    virtual void updateNode(AVLNode<Key, Value>* node) override;
+    virtual void nodeSwap(AVLNode<Key, Value>* n1, AVLNode<Key, Value>* n2) override;
+    virtual bool keepsSubtreeData() const override;
+    virtual AVLNode<Key, Value>* relocateNode(AVLNode<Key, Value>* node) override;
+
+    // Helper functions for aggregate()
+    static Summary summaryOf(ANode* node);
+    static Summary aggregateFrom(ANode* node, const Key& lo);
+    static Summary aggregateUpTo(ANode* node, const Key& hi);
+};
+
+template<class Key, class Value, class Aggregate>
+AVLNode<Key, Value>* AggregateAVLTree<Key, Value, Aggregate>::createNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent)
+{
+    return new ANode(key, value, static_cast<ANode*>(parent));
+}
+
+// Lets defragment() move nodes, the moved node carries the summary along
+template<class Key, class Value, class Aggregate>
+AVLNode<Key, Value>* AggregateAVLTree<Key, Value, Aggregate>::relocateNode(AVLNode<Key, Value>* node)
+{
+    void* memory = this->relocationMemory(sizeof(ANode), alignof(ANode));
+    if (!memory) return NULL;
+    return new (memory) ANode(std::move(*static_cast<ANode*>(node)));
+}
+
+/**
+* A changed value changes the summary of every ancestor.
+*/
+template<class Key, class Value, class Aggregate>
+void AggregateAVLTree<Key, Value, Aggregate>::valueUpdated(AVLNode<Key, Value>* node)
+{
+    this->updateHeights(node);
+}
+
+/**
+* Recomputes the height and the summary of a node from its children.
+*/
+template<class Key, class Value, class Aggregate>
+void AggregateAVLTree<Key, Value, Aggregate>::updateNode(AVLNode<Key, Value>* node)
+{
+    AVLTree<Key, Value>::updateNode(node);
+    ANode* n = static_cast<ANode*>(node);
+    Summary summary = Aggregate::combine(summaryOf(n->getLeft()), Aggregate::lift(n->getKey(), n->getValue()));
+    n->setSummary(Aggregate::combine(summary, summaryOf(n->getRight())));
+}
+
+// Summaries depend on every node below, so removals must refresh them up to the root
+template<class Key, class Value, class Aggregate>
+bool AggregateAVLTree<Key, Value, Aggregate>::keepsSubtreeData() const
+{
+    return true;
+}
+
+/**
+* Summaries belong to tree positions, like heights, so they are swapped along with them.
+*/
+template<class Key, class Value, class Aggregate>
+void AggregateAVLTree<Key, Value, Aggregate>::nodeSwap(AVLNode<Key, Value>* n1, AVLNode<Key, Value>* n2)
+{
+    AVLTree<Key, Value>::nodeSwap(n1, n2);
+    ANode* a1 = static_cast<ANode*>(n1);
+    ANode* a2 = static_cast<ANode*>(n2);
+    Summary temp = a1->getSummary();
+    a1->setSummary(a2->getSummary());
+    a2->setSummary(temp);
+}
+
+template<class Key, class Value, class Aggregate>
+typename Aggregate::value_type AggregateAVLTree<Key, Value, Aggregate>::summaryOf(ANode* node)
+{
+    return node ? node->getSummary() : Aggregate::identity();
+}
+
+// Summary of every key >= lo in the subtree, walking down the left boundary of the range
+template<class Key, class Value, class Aggregate>
+typename Aggregate::value_type AggregateAVLTree<Key, Value, Aggregate>::aggregateFrom(ANode* node, const Key& lo)
+{
+    Summary result = Aggregate::identity();
+    while (node)
+    {
+        if (node->getKey() < lo) node = node->getRight(); // node and its left subtree are out of range
+        else
+        {
+            // node and its whole right subtree are in range, and come before what we have so far
+            Summary inRange = Aggregate::combine(Aggregate::lift(node->getKey(), node->getValue()), summaryOf(node->getRight()));
+            result = Aggregate::combine(inRange, result);
+            node = node->getLeft();
+        }
+    }
+    return result;
+}
+
+// Summary of every key <= hi in the subtree, the mirror image of aggregateFrom()
+template<class Key, class Value, class Aggregate>
+typename Aggregate::value_type AggregateAVLTree<Key, Value, Aggregate>::aggregateUpTo(ANode* node, const Key& hi)
+{
+    Summary result = Aggregate::identity();
+    while (node)
+    {
+        if (hi < node->getKey()) node = node->getLeft();
+        else
+        {
+            Summary inRange = Aggregate::combine(summaryOf(node->getLeft()), Aggregate::lift(node->getKey(), node->getValue()));
+            result = Aggregate::combine(result, inRange);
+            node = node->getRight();
+        }
+    }
+    return result;
+}
+
+/**
+* Finds the highest node inside [lo, hi] (where the search paths for lo and hi part ways),
+* then adds up the left boundary below it, the node itself and the right boundary below it.
+*/
+template<class Key, class Value, class Aggregate>
+typename Aggregate::value_type AggregateAVLTree<Key, Value, Aggregate>::aggregate(const Key& lo, const Key& hi) const
+{
+    ANode* node = static_cast<ANode*>(this->root_);
+    while (node)
+    {
+        if (hi < node->getKey()) node = node->getLeft();
+        else if (node->getKey() < lo) node = node->getRight();
+        else break;
+    }
+    if (!node) return Aggregate::identity();
+    Summary result = aggregateFrom(node->getLeft(), lo);
+    result = Aggregate::combine(result, Aggregate::lift(node->getKey(), node->getValue()));
+    return Aggregate::combine(result, aggregateUpTo(node->getRight(), hi));
+}
+
+template<class Key, class Value, class Aggregate>
+typename Aggregate::value_type AggregateAVLTree<Key, Value, Aggregate>::aggregate() const
+{
+    return summaryOf(static_cast<ANode*>(this->root_));
+}
+
+#endif
@@ -5,10 +5,179 @@
 #include <exception>
 #include <cstdlib>
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <typeinfo>
+#include <vector>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 #include "bst.h"
+#include "parallel.h"
+
+// Building with AVL_LATENCY_HISTOGRAMS defined times insert(), remove(), pop_min()/pop_max()
+// and clear() into the histograms of latency_histogram.h; otherwise the scopes compile to nothing
+#ifdef AVL_LATENCY_HISTOGRAMS
+#include "latency_histogram.h"
+#define AVL_LATENCY_SCOPE(operation, size) AVLLatencyScope avlLatencyScope(AVLLatency::operation, size)
+#else
+#define AVL_LATENCY_SCOPE(operation, size) ((void)0)
+#endif
 
 struct KeyError { };
 
+/**
+* A block of memory that AVLTree::defragment() packs relocated nodes into, in key order.
+* Chunks are aligned to their size, so a node inside one finds the header at the start of
+* its chunk by masking its own address. The header counts the nodes living in the chunk,
+* plus one while a tree is still filling it, and whoever drops the count to zero frees the
+* chunk. Nodes in a chunk are freed with plain delete like any other node (see
+* AVLNode::operator delete), so they can move between trees and node handles as usual.
+*/
+struct AVLNodeChunk
+{
+    static const int kShift = 16;
+    static const size_t kBytes = static_cast<size_t>(1) << kShift;
+
+    // Allocates an empty chunk, holding the one reference of the tree that fills it. Returns
+    // NULL for memory too high up in the address space for contains() to keep track of
+    static AVLNodeChunk* create()
+    {
+        void* memory = allocateAligned();
+        if (!track(memory, true))
+        {
+            freeAligned(memory);
+            return NULL;
+        }
+        return new (memory) AVLNodeChunk();
+    }
+
+    // The chunk that memory returned by allocate() belongs to
+    static AVLNodeChunk* of(const void* memory)
+    {
+        return reinterpret_cast<AVLNodeChunk*>(reinterpret_cast<uintptr_t>(memory) & ~static_cast<uintptr_t>(kBytes - 1));
+    }
+
+    /**
+    * Whether memory lies inside a chunk that exists right now. A chunk owns all of its
+    * kBytes, so no other allocation can share them, and this decides from the address alone.
+    * Takes no lock: one load while no chunk exists at all, three otherwise.
+    */
+    static bool contains(const void* memory)
+    {
+        if (!live().load(std::memory_order_relaxed)) return false;
+        uint64_t index = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(memory)) >> kShift;
+        if (index >> (kAddressBits - kShift)) return false;
+        Leaf* leaf = leaves()[index >> kLeafBits].load(std::memory_order_acquire);
+        if (!leaf) return false;
+        size_t bit = static_cast<size_t>(index & ((1 << kLeafBits) - 1));
+        return (leaf->bits[bit / 64].load(std::memory_order_relaxed) >> (bit % 64)) & 1;
+    }
+
+    // Carves size bytes off the free end and takes a reference for them, or returns NULL if they do not fit
+    void* allocate(size_t size, size_t alignment)
+    {
+        size_t offset = (used + alignment - 1) & ~(alignment - 1);
+        if (offset + size > kBytes) return NULL;
+        used = offset + size;
+        refs.fetch_add(1);
+        char* memory = reinterpret_cast<char*>(this) + offset;
+        if (!first) first = memory;
+        return memory;
+    }
+
+    void release()
+    {
+        if (refs.fetch_sub(1) != 1) return;
+        this->~AVLNodeChunk();
+        track(this, false); // Before the memory can be handed out again
+        freeAligned(this);
+    }
+
+    std::atomic<size_t> refs;
+    size_t used; // Bytes handed out so far, counting this header
+    const void* first; // The first node placed in the chunk, NULL while there is none
+
+private:
+    // contains() keeps one bit per kBytes of address space below 2^kAddressBits, in leaves of
+    // 2^kLeafBits bits (8 KiB) that are allocated when a chunk first lands in their 4 GiB and
+    // then kept, so readers never see one go away
+    static const int kAddressBits = 48;
+    static const int kLeafBits = 16;
+
+    struct Leaf
+    {
+        std::atomic<uint64_t> bits[(1 << kLeafBits) / 64];
+    };
+
+    AVLNodeChunk() : refs(1), used(sizeof(AVLNodeChunk)), first(NULL) {}
+
+    static void* allocateAligned()
+    {
+#ifdef _WIN32
+        void* memory = _aligned_malloc(kBytes, kBytes);
+#else
+        void* memory = NULL;
+        if (posix_memalign(&memory, kBytes, kBytes) != 0) memory = NULL;
+#endif
+        if (!memory) throw std::bad_alloc();
+        return memory;
+    }
+
+    static void freeAligned(void* memory)
+    {
+#ifdef _WIN32
+        _aligned_free(memory);
+#else
+        std::free(memory);
+#endif
+    }
+
+    // Sets or clears the bit of the chunk at memory; false if it is out of range
+    static bool track(const void* memory, bool present)
+    {
+        uint64_t index = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(memory)) >> kShift;
+        if (index >> (kAddressBits - kShift)) return false;
+        std::lock_guard<std::mutex> guard(lock());
+        std::atomic<Leaf*>& slot = leaves()[index >> kLeafBits];
+        Leaf* leaf = slot.load(std::memory_order_relaxed);
+        if (!leaf)
+        {
+            leaf = new Leaf();
+            slot.store(leaf, std::memory_order_release);
+        }
+        size_t bit = static_cast<size_t>(index & ((1 << kLeafBits) - 1));
+        uint64_t mask = static_cast<uint64_t>(1) << (bit % 64);
+        if (present) leaf->bits[bit / 64].fetch_or(mask, std::memory_order_relaxed);
+        else leaf->bits[bit / 64].fetch_and(~mask, std::memory_order_relaxed);
+        if (present) live().fetch_add(1, std::memory_order_relaxed);
+        else live().fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    static std::atomic<Leaf*>* leaves()
+    {
+        static std::atomic<Leaf*> table[1 << (kAddressBits - kShift - kLeafBits)];
+        return table;
+    }
+
+    static std::atomic<size_t>& live()
+    {
+        static std::atomic<size_t> count(0);
+        return count;
+    }
+
+    static std::mutex& lock()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+};
+
 /**
 * A special kind of node for an AVL tree, which adds the height as a data member, plus
 * other additional helper functions. You do NOT need to implement any functionality or
@@ -20,12 +189,23 @@ class AVLNode : public Node<Key, Value>
 public:
     // Constructor/destructor.
     AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
+    AVLNode(AVLNode<Key, Value>&& other);
     virtual ~AVLNode();
 
     // Getter/setter for the node's height.
     int getHeight () const;
     void setHeight (int height);
 
+    // Whether the node was placed in an AVLNodeChunk by AVLTree::defragment()
+    bool isInChunk() const;
+    void setInChunk(bool inChunk);
+
+    // Nodes in a chunk share their allocation, so they are freed into the chunk rather than with ::operator delete
+    static void* operator new(size_t size);
+    static void* operator new(size_t size, void* where);
+    static void operator delete(void* memory);
+    static void operator delete(void* memory, void* where);
+
     // Getters for parent, left, and right. These need to be redefined since they
     // return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
     // for more information.
@@ -34,7 +214,9 @@ public:
     virtual AVLNode<Key, Value>* getRight() const override;
 
 protected:
-    int height_;
+    // Heights never come near 2^31, so the chunk flag shares their word and nodes do not grow
+    unsigned height_ : 31;
+    unsigned inChunk_ : 1;
 };
 
 /*
@@ -49,13 +231,24 @@ protected:
 */
 template<class Key, class Value>
 AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value> *parent) :
-    Node<Key, Value>(key, value, parent), height_(1)
+    Node<Key, Value>(key, value, parent), height_(1), inChunk_(0)
+{
+
+}
+
+/**
+* A move constructor, used by AVLTree::relocateNode(). The new node is not in a chunk until
+* AVLTree::replaceNode() says so.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value>::AVLNode(AVLNode<Key, Value>&& other) :
+    Node<Key, Value>(std::move(other)), height_(other.height_), inChunk_(0)
 {
 
 }
 
 /**
-* A destructor which does nothing.
+* A destructor, which does not need to do anything.
 */
 template<class Key, class Value>
 AVLNode<Key, Value>::~AVLNode()
@@ -81,6 +274,49 @@ void AVLNode<Key, Value>::setHeight(int height)
     height_ = height;
 }
 
+template<class Key, class Value>
+bool AVLNode<Key, Value>::isInChunk() const
+{
+    return inChunk_;
+}
+
+template<class Key, class Value>
+void AVLNode<Key, Value>::setInChunk(bool inChunk)
+{
+    inChunk_ = inChunk;
+}
+
+template<class Key, class Value>
+void* AVLNode<Key, Value>::operator new(size_t size)
+{
+    return ::operator new(size);
+}
+
+// Placement form, used by AVLTree::relocateNode() to construct nodes in chunk memory
+template<class Key, class Value>
+void* AVLNode<Key, Value>::operator new(size_t, void* where)
+{
+    return where;
+}
+
+/**
+* Runs after the node is destroyed, so where its memory came from is decided by the address
+* alone. Chunk nodes give their reference on the chunk back instead of freeing their memory.
+*/
+template<class Key, class Value>
+void AVLNode<Key, Value>::operator delete(void* memory)
+{
+    if (AVLNodeChunk::contains(memory)) AVLNodeChunk::of(memory)->release();
+    else ::operator delete(memory);
+}
+
+// Only called if a constructor throws during placement new, which leaves the slot unused
+template<class Key, class Value>
+void AVLNode<Key, Value>::operator delete(void* memory, void*)
+{
+    AVLNodeChunk::of(memory)->release();
+}
+
 /**
 * An overridden function for getting the parent since a static_cast is necessary to make sure
 * that our node is a AVLNode.
@@ -116,19 +352,174 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
   -----------------------------------------------
 */
 
+/**
+* Balancing policies for AVLTree. A policy is a set of constants that choose between the
+* rebalancing algorithms implemented in AVLTree:
+*   kRankBalanced     false: AVLNode's height is the subtree height and a node is rebalanced
+*                     once its children's heights differ by more than kSlack.
+*                     true: AVLNode's height is a WAVL rank, see WAVLBalance
+*   kSlack            the largest height difference tolerated between siblings
+*   kJoinable         whether the split/join based bulk operations (insert_batch(),
+*                     remove_batch(), range erase(), split_at(), concat()) may be used. Their
+*                     rebalancing assumes strict AVL trees, so the other policies fall back
+*                     to one insert/remove per key.
+* isBalanced() checks the strict AVL property, so it only holds under AVLBalance.
+*/
+struct AVLBalance
+{
+    static const bool kRankBalanced = false;
+    static const int kSlack = 1;
+    static const bool kJoinable = true;
+};
+
+/**
+* AVL balancing that tolerates a height difference of up to Slack between siblings. Trees
+* get taller (the height bound grows with Slack) but insertions and, above all, removals
+* rotate much less often.
+*/
+template <int Slack>
+struct RelaxedAVLBalance
+{
+    static_assert(Slack >= 1, "RelaxedAVLBalance needs a slack of at least 1");
+    static const bool kRankBalanced = false;
+    static const int kSlack = Slack;
+    static const bool kJoinable = Slack == 1;
+};
+
+/**
+* Weak AVL (rank-balanced) trees, from Haeupler, Sen and Tarjan: every node has a rank, the
+* rank difference to each child is 1 or 2 (a missing child has rank 0) and leaves have rank 1.
+* Without removals a WAVL tree is an AVL tree. Insertion and removal each do at most two
+* rotations, where AVL removal may rotate at every level, and the height stays below 2 log2 n.
+*/
+struct WAVLBalance
+{
+    static const bool kRankBalanced = true;
+    static const int kSlack = 1;
+    static const bool kJoinable = false;
+};
 
-template <class Key, class Value>
+template <class Key, class Value, class Balance = AVLBalance>
 class AVLTree : public BinarySearchTree<Key, Value>
 {
 public:
+    typedef typename BinarySearchTree<Key, Value>::iterator iterator;
+
+    AVLTree();
+    virtual ~AVLTree();
+
+    /**
+    * An owning handle to a node taken out of a tree by extract(). Its value can be changed,
+    * and it can be linked into this or another tree of the same type with
+    * insert(node_type&&), without being reallocated or copied. If the handle still owns
+    * a node when it is destroyed, the node is freed.
+    */
+    class node_type
+    {
+    public:
+        node_type();
+        node_type(node_type&& other);
+        node_type& operator=(node_type&& other);
+        ~node_type();
+
+        bool empty() const;
+        // The key is const inside the node, so re-keying goes through insert(node_type&&, const Key&)
+        const Key& key() const;
+        Value& mapped() const;
+
+    protected:
+        friend class AVLTree<Key, Value, Balance>;
+        node_type(AVLNode<Key, Value>* node, const std::type_info* treeType);
+        node_type(const node_type&);
+        node_type& operator=(const node_type&);
+        AVLNode<Key, Value>* node_;
+        const std::type_info* treeType_; // Dynamic type of the tree it came from, which fixes the node type
+    };
+
+    /**
+    * A cursor remembers the node it last landed on. Each search starts from there, climbs
+    * only until the key is known to be in the current subtree and descends from that point,
+    * so a search for a key near the previous one takes O(log d) steps for a rank distance d
+    * instead of a full descent from the root. Like an iterator, a cursor is invalidated when
+    * the node it rests on is removed from the tree.
+    */
+    class cursor
+    {
+    public:
+        cursor();
+
+        // Moves to the first key not less than key and returns an iterator to it
+        iterator seek(const Key& key);
+        // Moves to key and returns an iterator to it, or end() if it is missing
+        iterator find(const Key& key);
+        // Inserts (or updates, like AVLTree::insert()) starting from the cursor and moves to the new entry
+        iterator insert(const std::pair<const Key, Value>& keyValuePair);
+
+    protected:
+        friend class AVLTree<Key, Value, Balance>;
+        explicit cursor(AVLTree<Key, Value, Balance>* tree);
+        AVLNode<Key, Value>* search(const Key& key, AVLNode<Key, Value>*& last) const;
+        AVLTree<Key, Value, Balance>* tree_;
+        AVLNode<Key, Value>* node_; // Where the last search ended, NULL to start from the root
+    };
+
+    // Returns a cursor that starts at the root
+    cursor get_cursor();
+
     virtual void insert (const std::pair<const Key, Value> &new_item);
     virtual void remove(const Key& key);
+#ifdef AVL_LATENCY_HISTOGRAMS
+    // Only so the time it takes can be recorded, the work is done by BinarySearchTree::clear()
+    void clear();
+#endif
+    // The ends of the tree and its size are cached, so these are all O(1)
+    size_t size() const;
+    iterator begin() const;
+    iterator min() const;
+    iterator max() const;
+    // Remove and return the smallest/largest entry, see the comments above their implementations
+    std::pair<Key, Value> pop_min();
+    std::pair<Key, Value> pop_max();
+    // Node handles, see the comments above their implementations
+    node_type extract(const Key& key);
+    node_type extract(iterator position);
+    iterator insert(node_type&& handle);
+    iterator insert(node_type&& handle, const Key& key);
+    void merge(AVLTree<Key, Value, Balance>& other);
+    // Range erase, see the comments above their implementations
+    size_t erase(const Key& lo, const Key& hi);
+    size_t erase(iterator first, iterator last);
+    // Batched updates, see the comments above their implementations
+    template <typename InputIt> void insert_batch(InputIt first, InputIt last, unsigned threads = 0);
+    template <typename InputIt> void remove_batch(InputIt first, InputIt last, unsigned threads = 0);
+    template <typename InputIt> void assign(InputIt first, InputIt last, unsigned threads = 0);
+    // Moves every key >= key into upper, which must be empty
+    void split_at(const Key& key, AVLTree<Key, Value, Balance>& upper);
+    // Moves every key of other into this tree, the key ranges of the two trees must not overlap
+    void concat(AVLTree<Key, Value, Balance>& other);
+    // Deferred rebalancing, see the comments above their implementations
+    void begin_bulk();
+    void end_bulk();
+    // Full scans split over several threads, see the comments above their implementations
+    template <typename F> void parallel_for_each(F f, unsigned threads = 0) const;
+    template <typename T, typename Lift, typename Combine>
+    T parallel_reduce(const T& identity, Lift lift, Combine combine, unsigned threads = 0) const;
+    // Moves up to budget nodes into key-ordered memory, see the comments above its implementation
+    bool defragment(size_t budget);
 protected:
     virtual void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
+    // Allocates a new node, overridden by trees that store extra data in their nodes
+    virtual AVLNode<Key, Value>* createNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
+    // Called after insert() overwrites the value of an existing key
+    virtual void valueUpdated(AVLNode<Key, Value>* node);
+    virtual void treeCleared() override;
 
     // Add helper functions here
     void leftRotate(AVLNode<Key, Value>* node);
     void rightRotate(AVLNode<Key, Value>* node);
+    // This function updates the height of a single node from its children. Every place that changes
+    // a node's children calls it bottom-up, so subclasses override it to maintain their own per-subtree data
+    virtual void updateNode(AVLNode<Key, Value>* node);
     // This function updates the height of a node and all its ancestors
     void updateHeights(AVLNode<Key, Value>* node);
     // This function calculates the difference in heights (i.e. balance factor)
@@ -137,10 +528,281 @@ protected:
     int findXYZ(AVLNode<Key, Value>*& x, AVLNode<Key, Value>*& y, AVLNode<Key, Value>*& z, AVLNode<Key, Value>*& start);
     // Balance the tree according to the balanceMode
     void balance(AVLNode<Key, Value>* x, AVLNode<Key, Value>* y, AVLNode<Key, Value>* z, int balanceMode);
+    // The retracing halves of insert() and remove()
+    void rebalanceAfterInsert(AVLNode<Key, Value>* parent);
+    void rebalanceAfterRemove(AVLNode<Key, Value>* start);
+    // Link/unlink an existing node, shared by insert()/remove() and the node handle functions
+    AVLNode<Key, Value>* linkNode(AVLNode<Key, Value>* newNode);
+    AVLNode<Key, Value>* unlinkNode(AVLNode<Key, Value>* node);
+
+    // Split/join helpers. They work on detached subtrees and return the new subtree root
+    static int height(AVLNode<Key, Value>* node);
+    AVLNode<Key, Value>* join(AVLNode<Key, Value>* left, AVLNode<Key, Value>* middle, AVLNode<Key, Value>* right);
+    AVLNode<Key, Value>* joinRight(AVLNode<Key, Value>* left, AVLNode<Key, Value>* middle, AVLNode<Key, Value>* right);
+    AVLNode<Key, Value>* joinLeft(AVLNode<Key, Value>* left, AVLNode<Key, Value>* middle, AVLNode<Key, Value>* right);
+    AVLNode<Key, Value>* join2(AVLNode<Key, Value>* left, AVLNode<Key, Value>* right);
+    void split(AVLNode<Key, Value>* node, const Key& key, AVLNode<Key, Value>*& left, AVLNode<Key, Value>*& found, AVLNode<Key, Value>*& right);
+    void splitLast(AVLNode<Key, Value>* node, AVLNode<Key, Value>*& rest, AVLNode<Key, Value>*& last);
+    AVLNode<Key, Value>* buildBalanced(const std::pair<Key, Value>* items, size_t count, int depth);
+    template <typename InputIt> static void sortBatch(InputIt first, InputIt last, int depth, std::vector<std::pair<Key, Value> >& items);
+    AVLNode<Key, Value>* unionBatch(AVLNode<Key, Value>* node, const std::pair<Key, Value>* items, size_t count, int depth, size_t& added);
+    AVLNode<Key, Value>* differenceBatch(AVLNode<Key, Value>* node, const Key* keys, size_t count, int depth, size_t& removed);
+    // Frees every node of a detached subtree and returns how many there were
+    static size_t freeSubtree(AVLNode<Key, Value>* node);
+    // One node at a time versions of the split/join based operations, for policies that are not kJoinable
+    size_t eraseNodes(iterator first, iterator last);
+    void moveNodes(AVLTree<Key, Value, Balance>& from, iterator first);
+
+    // WAVL rebalancing, used instead of the height based retracing when Balance::kRankBalanced
+    void rankRebalanceAfterInsert(AVLNode<Key, Value>* parent);
+    void rankRebalanceAfterRemove(AVLNode<Key, Value>* parent);
+    // Rotates node up over its parent, keeping root_ current
+    void rotateUp(AVLNode<Key, Value>* node);
+    // Rebalances the subtree at an unbalanced node with local height updates and returns its new root
+    AVLNode<Key, Value>* restructure(AVLNode<Key, Value>* z);
+    // Whether updateNode() keeps per-subtree data besides the height, which every ancestor of a change depends on
+    virtual bool keepsSubtreeData() const;
+
+    // Cache upkeep: nodeLinked() after a new leaf is linked, nodeUnlinking() before a node is
+    // unlinked, resetCache() after root_ is replaced wholesale
+    void nodeLinked(AVLNode<Key, Value>* node);
+    void nodeUnlinking(AVLNode<Key, Value>* node);
+    void resetCache(size_t size);
+    std::pair<Key, Value> popNode(AVLNode<Key, Value>* node);
+
+    // Bulk mode helpers
+    bool joinable() const;
+    bool bulkAppend(const std::pair<const Key, Value>& item);
+    bool bulkLink(AVLNode<Key, Value>* node);
+    void rebuildBalanced();
+    AVLNode<Key, Value>* relinkBalanced(AVLNode<Key, Value>** nodes, size_t count);
+
+    // Defragmentation helpers. relocateNode() copies node into memory from relocationMemory() and
+    // returns the copy, or NULL to leave the node where it is; trees with their own node type override it
+    virtual AVLNode<Key, Value>* relocateNode(AVLNode<Key, Value>* node);
+    void* relocationMemory(size_t size, size_t alignment);
+    void replaceNode(AVLNode<Key, Value>* node, AVLNode<Key, Value>* moved);
+    static bool laidOut(const AVLNode<Key, Value>* node, const void* previous);
+    static AVLNode<Key, Value>* successor(AVLNode<Key, Value>* node);
+
+    // Parallel scan helpers
+    template <typename F> static void visitInOrder(AVLNode<Key, Value>* root, F& visit);
+    template <typename F> static void forEachHelper(AVLNode<Key, Value>* node, F& f, int depth);
+    template <typename T, typename Lift, typename Combine>
+    static T reduceHelper(AVLNode<Key, Value>* node, const T& identity, Lift& lift, Combine& combine, int depth);
+
+    bool bulk_; // In bulk mode nothing is rebalanced and heights are not kept, see begin_bulk()
+    AVLNode<Key, Value>* min_; // The smallest and largest nodes, NULL when the tree is empty
+    AVLNode<Key, Value>* max_;
+    mutable size_t size_; // Number of nodes, or kUnknownSize until size() counts them again
+    AVLNodeChunk* defragChunk_; // The chunk defragment() is filling, NULL before its first move
+    AVLNode<Key, Value>* defragNext_; // Where the current defragment() pass resumes, NULL to start a new pass
+    const void* defragLast_; // Where the node before defragNext_ ended up, only compared and never followed
+
+    static const size_t kUnknownSize = static_cast<size_t>(-1);
+
+    // Subproblems smaller than this are never handed to another thread
+    static const size_t kParallelGrain = 2048;
+    // Subtrees lower than this are scanned by one thread (an AVL subtree of height 12 holds 376 to 4095 nodes)
+    static const int kParallelHeight = 12;
 };
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::leftRotate(AVLNode<Key, Value>* node)
+/*
+  ------------------------------------------------
+  Begin implementations for the AVLTree::node_type.
+  ------------------------------------------------
+*/
+
+template<class Key, class Value, class Balance>
+AVLTree<Key, Value, Balance>::node_type::node_type() : node_(NULL), treeType_(NULL)
+{
+}
+
+template<class Key, class Value, class Balance>
+AVLTree<Key, Value, Balance>::node_type::node_type(AVLNode<Key, Value>* node, const std::type_info* treeType) :
+    node_(node), treeType_(treeType)
+{
+}
+
+template<class Key, class Value, class Balance>
+AVLTree<Key, Value, Balance>::node_type::node_type(node_type&& other) : node_(other.node_), treeType_(other.treeType_)
+{
+    other.node_ = NULL;
+}
+
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::node_type& AVLTree<Key, Value, Balance>::node_type::operator=(node_type&& other)
+{
+    if (this != &other)
+    {
+        delete node_;
+        node_ = other.node_;
+        treeType_ = other.treeType_;
+        other.node_ = NULL;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Balance>
+AVLTree<Key, Value, Balance>::node_type::~node_type()
+{
+    delete node_;
+}
+
+template<class Key, class Value, class Balance>
+bool AVLTree<Key, Value, Balance>::node_type::empty() const
+{
+    return node_ == NULL;
+}
+
+template<class Key, class Value, class Balance>
+const Key& AVLTree<Key, Value, Balance>::node_type::key() const
+{
+    return node_->getKey();
+}
+
+template<class Key, class Value, class Balance>
+Value& AVLTree<Key, Value, Balance>::node_type::mapped() const
+{
+    return node_->getValue();
+}
+
+/*
+  ----------------------------------------------
+  End implementations for the AVLTree::node_type.
+  ----------------------------------------------
+*/
+
+/*
+  ---------------------------------------------
+  Begin implementations for the AVLTree::cursor.
+  ---------------------------------------------
+*/
+
+template<class Key, class Value, class Balance>
+AVLTree<Key, Value, Balance>::cursor::cursor() : tree_(NULL), node_(NULL)
+{
+}
+
+template<class Key, class Value, class Balance>
+AVLTree<Key, Value, Balance>::cursor::cursor(AVLTree<Key, Value, Balance>* tree) : tree_(tree), node_(NULL)
+{
+}
+
+/**
+* Climbs from the cursor's node to the lowest ancestor whose subtree must hold key, then
+* descends from there. A subtree reached through a left child link has that parent's key as
+* an upper bound, so when key is larger than the start key the climb ends at the first
+* parent reached from its left with a key not below key (mirrored for smaller keys).
+* Returns the node holding key, or NULL with last set to the node key would be linked under.
+*/
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::cursor::search(const Key& key, AVLNode<Key, Value>*& last) const
+{
+    AVLNode<Key, Value>* node = node_ ? node_ : static_cast<AVLNode<Key, Value>*>(tree_->root_);
+    last = NULL;
+    if (!node) return NULL;
+    if (node->getKey() == key) return node;
+    bool up = node->getKey() < key;
+    while (node->getParent())
+    {
+        AVLNode<Key, Value>* parent = node->getParent();
+        bool reached = up ? parent->getLeft() == node && !(parent->getKey() < key)
+                          : parent->getRight() == node && !(key < parent->getKey());
+        node = parent;
+        if (reached) break;
+    }
+    while (node)
+    {
+        last = node;
+        if (key < node->getKey()) node = node->getLeft();
+        else if (node->getKey() < key) node = node->getRight();
+        else return node;
+    }
+    return NULL;
+}
+
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::iterator AVLTree<Key, Value, Balance>::cursor::seek(const Key& key)
+{
+    AVLNode<Key, Value>* last = NULL;
+    AVLNode<Key, Value>* found = search(key, last);
+    if (found)
+    {
+        node_ = found;
+        return tree_->makeIterator(found);
+    }
+    if (!last) return tree_->end();
+    node_ = last;
+    iterator it = tree_->makeIterator(last);
+    if (last->getKey() < key) ++it; // key would be last's right child, so the next key is last's successor
+    return it;
+}
+
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::iterator AVLTree<Key, Value, Balance>::cursor::find(const Key& key)
+{
+    AVLNode<Key, Value>* last = NULL;
+    AVLNode<Key, Value>* found = search(key, last);
+    node_ = found ? found : last;
+    return found ? tree_->makeIterator(found) : tree_->end();
+}
+
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::iterator AVLTree<Key, Value, Balance>::cursor::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    if (tree_->bulk_) // Bulk mode keeps its own bookkeeping in insert()
+    {
+        tree_->insert(keyValuePair);
+        return find(keyValuePair.first);
+    }
+    AVLNode<Key, Value>* last = NULL;
+    AVLNode<Key, Value>* node = search(keyValuePair.first, last);
+    if (node) // If same key, update value
+    {
+        node->setValue(keyValuePair.second);
+        tree_->valueUpdated(node);
+    }
+    else
+    {
+        node = tree_->createNode(keyValuePair.first, keyValuePair.second, last);
+        if (!last) tree_->root_ = node;
+        else if (keyValuePair.first < last->getKey()) last->setLeft(node);
+        else last->setRight(node);
+        tree_->nodeLinked(node);
+        if (last) tree_->rebalanceAfterInsert(last);
+    }
+    node_ = node;
+    return tree_->makeIterator(node);
+}
+
+/*
+  -------------------------------------------
+  End implementations for the AVLTree::cursor.
+  -------------------------------------------
+*/
+
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::cursor AVLTree<Key, Value, Balance>::get_cursor()
+{
+    return cursor(this);
+}
+
+template<class Key, class Value, class Balance>
+AVLTree<Key, Value, Balance>::AVLTree() :
+    bulk_(false), min_(NULL), max_(NULL), size_(0), defragChunk_(NULL), defragNext_(NULL), defragLast_(NULL)
+{
+}
+
+// The nodes are freed by ~BinarySearchTree() afterwards; those in chunks keep their chunk alive until then
+template<class Key, class Value, class Balance>
+AVLTree<Key, Value, Balance>::~AVLTree()
+{
+    if (defragChunk_) defragChunk_->release();
+}
+
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::leftRotate(AVLNode<Key, Value>* node)
 {
     AVLNode<Key, Value>* rightChild = node->getRight();
     AVLNode<Key, Value>* rightLeftChild = rightChild->getLeft(); // The left subtree of the right child's position need to change after left rotate
@@ -165,8 +827,8 @@ void AVLTree<Key, Value>::leftRotate(AVLNode<Key, Value>* node)
     node->setParent(rightChild);
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::rightRotate(AVLNode<Key, Value>* node)
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::rightRotate(AVLNode<Key, Value>* node)
 {
     AVLNode<Key, Value>* leftChild = node->getLeft();
     AVLNode<Key, Value>* leftRightChild = leftChild->getRight(); // The right subtree of the left child's position need to change after right rotate
@@ -191,23 +853,40 @@ void AVLTree<Key, Value>::rightRotate(AVLNode<Key, Value>* node)
     node->setParent(leftChild);
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::updateHeights(AVLNode<Key, Value>* node)
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::createNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent)
+{
+    return new AVLNode<Key, Value>(key, value, parent);
+}
+
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::valueUpdated(AVLNode<Key, Value>* /*node*/)
+{
+    // Nothing depends on values in a plain AVL tree
+}
+
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::updateNode(AVLNode<Key, Value>* node)
+{
+    if (Balance::kRankBalanced) return; // Ranks are only changed by the WAVL rebalancing itself
+    // Update the height as the max of left subtree and right subtree + 1, if no subtree, that subtree's height is 0
+    int leftHeight = node->getLeft() ? node->getLeft()->getHeight() : 0;
+    int rightHeight = node->getRight() ? node->getRight()->getHeight() : 0;
+    node->setHeight(std::max(leftHeight, rightHeight) + 1);
+}
+
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::updateHeights(AVLNode<Key, Value>* node)
 {
-    int leftHeight;
-    int rightHeight;
     while (node) // Until we have reached the root (i.e. root's parent is NULL)
     {
-        // Update the height as the max of left subtree and right subtree + 1, if no subtree, that subtree's height is 0
-        leftHeight = node->getLeft() ? node->getLeft()->getHeight() : 0;
-        rightHeight = node->getRight() ? node->getRight()->getHeight() : 0;
-        node->setHeight(std::max(leftHeight, rightHeight) + 1);
+        updateNode(node);
         node = node->getParent();
     }
 }
 
-template<class Key, class Value>
-int AVLTree<Key, Value>::calculateBF(AVLNode<Key, Value>* node)
+template<class Key, class Value, class Balance>
+int AVLTree<Key, Value, Balance>::calculateBF(AVLNode<Key, Value>* node)
 {
     // If no subtree, that subtree's height is 0
     int leftHeight = node->getLeft() ? node->getLeft()->getHeight() : 0;
@@ -215,8 +894,8 @@ int AVLTree<Key, Value>::calculateBF(AVLNode<Key, Value>* node)
     return std::abs(rightHeight - leftHeight);
 }
 
-template<class Key, class Value>
-int AVLTree<Key, Value>::findXYZ(AVLNode<Key, Value>*& x, AVLNode<Key, Value>*& y, AVLNode<Key, Value>*& z, AVLNode<Key, Value>*& start)
+template<class Key, class Value, class Balance>
+int AVLTree<Key, Value, Balance>::findXYZ(AVLNode<Key, Value>*& x, AVLNode<Key, Value>*& y, AVLNode<Key, Value>*& z, AVLNode<Key, Value>*& start)
 {
     bool firstLeft = false; // This flag stores whether we first go left or right
     z = start; // start is the first unbalanced node, so is z
@@ -258,8 +937,8 @@ int AVLTree<Key, Value>::findXYZ(AVLNode<Key, Value>*& x, AVLNode<Key, Value>*&
     else return 4; // First right then left
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::balance(AVLNode<Key, Value>* x, AVLNode<Key, Value>* y, AVLNode<Key, Value>* z, int balanceMode)
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::balance(AVLNode<Key, Value>* x, AVLNode<Key, Value>* y, AVLNode<Key, Value>* z, int balanceMode)
 {
     // If straight line, y is going to be the parent of x and z, so updating x and z and their ancestors' heights includes y
     if (balanceMode == 1) // Single left
@@ -295,13 +974,16 @@ void AVLTree<Key, Value>::balance(AVLNode<Key, Value>* x, AVLNode<Key, Value>* y
     }
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::insert(const std::pair<const Key, Value> &new_item)
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::insert(const std::pair<const Key, Value> &new_item)
 {
+    AVL_LATENCY_SCOPE(kInsert, size_);
+    if (bulk_ && bulkAppend(new_item)) return;
     // The same insert as bst
     if (!this->root_)
     {
-        this->root_ = new AVLNode<Key, Value>(new_item.first, new_item.second, NULL);
+        this->root_ = createNode(new_item.first, new_item.second, NULL);
+        nodeLinked(static_cast<AVLNode<Key, Value>*>(this->root_));
         return;
     }
     AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->root_);
@@ -318,6 +1000,7 @@ void AVLTree<Key, Value>::insert(const std::pair<const Key, Value> &new_item)
         else if (new_item.first == node->getKey()) // If same key, update value
         {
             node->setValue(new_item.second);
+            valueUpdated(node);
             return;
         }
         else // If larger, go right
@@ -327,11 +1010,25 @@ void AVLTree<Key, Value>::insert(const std::pair<const Key, Value> &new_item)
         }
     }
     // Insert at the appropriate position
-    AVLNode<Key, Value>* newNode = new AVLNode<Key, Value>(new_item.first, new_item.second, parent);
+    AVLNode<Key, Value>* newNode = createNode(new_item.first, new_item.second, parent);
     if (lastDirection) parent->setRight(newNode);
     else parent->setLeft(newNode);
+    nodeLinked(newNode);
 
     // Begin AVL-specific insert implementation
+    rebalanceAfterInsert(parent);
+}
+
+// Retraces from the parent of a newly linked leaf, fixing heights and the first unbalanced ancestor
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::rebalanceAfterInsert(AVLNode<Key, Value>* parent)
+{
+    if (bulk_) return;
+    if (Balance::kRankBalanced)
+    {
+        rankRebalanceAfterInsert(parent);
+        return;
+    }
     AVLNode<Key, Value>* temp = parent; // Need to declare a variable because we are using pointers which are changed in other functions
     updateHeights(temp); // After inserting a node, we need to update all its ancestors' heights
     AVLNode<Key, Value>* x = NULL;
@@ -341,7 +1038,7 @@ void AVLTree<Key, Value>::insert(const std::pair<const Key, Value> &new_item)
     int balanceMode = -1;
     while (temp)
     {
-        if (calculateBF(temp) >= 2) // This is the first unbalanced node
+        if (calculateBF(temp) > Balance::kSlack) // This is the first unbalanced node
         {
             balanceMode = findXYZ(x, y, z, temp);
             break; // We can break because the tree is guaranteed to be balanced after a single/double rotationss
@@ -351,112 +1048,1346 @@ void AVLTree<Key, Value>::insert(const std::pair<const Key, Value> &new_item)
     if (x && y && z) balance(x, y, z, balanceMode);
 }
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::remove(const Key& key)
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::remove(const Key& key)
 {
+    AVL_LATENCY_SCOPE(kRemove, size_);
     AVLNode<Key, Value>* findRes = static_cast<AVLNode<Key, Value>*>(this->internalFind(key));
-    if (findRes) // Only remove node that exists in the tree
-    {
-        AVLNode<Key, Value>* parent = static_cast<AVLNode<Key, Value>*>(findRes->getParent());
-        AVLNode<Key, Value>* predParent = NULL;
-        if (!findRes->getLeft() && !findRes->getRight()) // Leaf node
-        {
-            if (parent) // If findRes is not root (i.e. parent is not NULL)
-            {
-                // Find out which direction is the node and delete it
-                if (parent->getLeft() == findRes) parent->setLeft(NULL);
-                else parent->setRight(NULL);
-            }
-            else this->root_ = NULL; // If we are deleting the root, set it to NULL
-            delete findRes;
-        }
-        else if (findRes->getLeft() && !findRes->getRight() || !findRes->getLeft() && findRes->getRight()) // 1 child
-        {
-            AVLNode<Key, Value>* child = findRes->getLeft() ? findRes->getLeft() : findRes->getRight();
-            if (parent) // If findRes is not root (i.e. parent is not NULL)
-            {
-                // Find out which direction is the child and promote it
-                if (parent->getLeft() == findRes)
-                {
-                    delete findRes;
-                    parent->setLeft(child);
-                }
-                else
-                {
-                    delete findRes;
-                    parent->setRight(child);
-                }
-                child->setParent(parent);
-            }
-            else // If we are deleting root with only one child, promote the child as the new root
-            {
-                child->setParent(NULL);
-                this->root_ = child;
-                delete findRes;
-            }
-        }
-        else // 2 children
-        {
-            // If there are 2 children, swap the node with predecessor and delete it
-            AVLNode<Key, Value>* predecessor = static_cast<AVLNode<Key, Value>*>(this->predecessor(findRes));
-            nodeSwap(findRes, predecessor); // Now findRes is predecessor, predecessor is findRes
-            predParent = findRes->getParent();
-            // Delete the node after swap. Furthermore, after swap, it mustn't be the root. So no need to detect root anymore
-            // To be a predecessor, a node must only have 0 or 1 child. So only need to consider these 2 cases
-            // Copy the code from above
-            if (!findRes->getLeft() && !findRes->getRight()) // Leaf node
-            {
-                if (predParent->getLeft() == findRes) predParent->setLeft(NULL);
-                else predParent->setRight(NULL);
-                delete findRes;
-            }
-            else if (findRes->getLeft() && !findRes->getRight() || !findRes->getLeft() && findRes->getRight()) // 1 child
-            {
-                AVLNode<Key, Value>* child = findRes->getLeft() ? findRes->getLeft() : findRes->getRight();
-                if (predParent->getLeft() == findRes)
-                {
-                    delete findRes;
-                    predParent->setLeft(child);
-                }
-                else
-                {
-                    delete findRes;
-                    predParent->setRight(child);
-                }
-                child->setParent(predParent);
-            }
-        }
+    if (findRes) delete unlinkNode(findRes); // Only remove node that exists in the tree
+}
 
-        // Begin AVL-specific remove implementation
-        int balanceMode = -1;
-        AVLNode<Key, Value>* temp = predParent ? predParent : parent; // The start node may be swapped, so need to determine
-        updateHeights(temp); // After removing a node, we need to update all its ancestors' heights
-        AVLNode<Key, Value>* x = NULL;
-        AVLNode<Key, Value>* y = NULL;
-        AVLNode<Key, Value>* z = NULL;
-        while (temp) // We need a while loop because the tree might be unbalanced higher up if we remove
-        {
-            // std::cout << "Key: " << temp->getKey() << " Height: " << temp->getHeight() << std::endl;
-            if (calculateBF(temp) >= 2) // If this node is unbalanced
-            {
-                balanceMode = findXYZ(x, y, z, temp);
-                // break; // We can not break this time because the tree may be unbalanced higher up
-                if (balanceMode == 1 || balanceMode == 2) temp = y; // The new root of the subtree is y if straight line
-                else temp = x; // The new root of the subtree is x if zigzag
-                balance(x, y, z, balanceMode);
-            }
-            temp = temp->getParent();
-        }
-    }
+#ifdef AVL_LATENCY_HISTOGRAMS
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::clear()
+{
+    AVL_LATENCY_SCOPE(kClear, size_);
+    BinarySearchTree<Key, Value>::clear();
 }
+#endif
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::treeCleared()
 {
-    BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
+    resetCache(0);
+}
+
+/**
+* O(1), except that the first call after split_at() counts the nodes once, since splitting
+* in O(log n) cannot tell how many keys went to each side.
+*/
+template<class Key, class Value, class Balance>
+size_t AVLTree<Key, Value, Balance>::size() const
+{
+    if (size_ == kUnknownSize)
+    {
+        size_ = 0;
+        for (iterator it = begin(); it != this->end(); ++it) size_++;
+    }
+    return size_;
+}
+
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::iterator AVLTree<Key, Value, Balance>::begin() const
+{
+    return this->makeIterator(min_);
+}
+
+// An iterator to the smallest entry, or end() if the tree is empty
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::iterator AVLTree<Key, Value, Balance>::min() const
+{
+    return this->makeIterator(min_);
+}
+
+// An iterator to the largest entry, or end() if the tree is empty
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::iterator AVLTree<Key, Value, Balance>::max() const
+{
+    return this->makeIterator(max_);
+}
+
+/**
+* Removes the smallest entry and returns it, for using the tree as a priority queue. There
+* is no search: the cached node is unlinked directly and its successor becomes the new
+* minimum. Throws std::out_of_range if the tree is empty.
+*/
+template<class Key, class Value, class Balance>
+std::pair<Key, Value> AVLTree<Key, Value, Balance>::pop_min()
+{
+    if (!min_) throw std::out_of_range("AVLTree::pop_min: the tree is empty");
+    AVL_LATENCY_SCOPE(kPop, size_);
+    return popNode(min_);
+}
+
+// Mirror image of pop_min()
+template<class Key, class Value, class Balance>
+std::pair<Key, Value> AVLTree<Key, Value, Balance>::pop_max()
+{
+    if (!max_) throw std::out_of_range("AVLTree::pop_max: the tree is empty");
+    AVL_LATENCY_SCOPE(kPop, size_);
+    return popNode(max_);
+}
+
+template<class Key, class Value, class Balance>
+std::pair<Key, Value> AVLTree<Key, Value, Balance>::popNode(AVLNode<Key, Value>* node)
+{
+    unlinkNode(node);
+    std::pair<Key, Value> item(node->getKey(), std::move(node->getValue()));
+    delete node;
+    return item;
+}
+
+/**
+* Counts a newly linked leaf and makes it the smallest/largest node if it went in left of
+* the old smallest or right of the old largest. Rotations and nodeSwap() keep the in-order
+* sequence of nodes, so the cached pointers stay valid through rebalancing.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::nodeLinked(AVLNode<Key, Value>* node)
+{
+    if (size_ != kUnknownSize) size_++;
+    AVLNode<Key, Value>* parent = node->getParent();
+    if (!parent)
+    {
+        min_ = max_ = node;
+        return;
+    }
+    if (parent == min_ && parent->getLeft() == node) min_ = node;
+    if (parent == max_ && parent->getRight() == node) max_ = node;
+}
+
+/**
+* Uncounts a node that is about to be unlinked and moves the smallest/largest node pointers
+* off it, to its successor/predecessor. Neither extreme can have two children, so no search
+* is needed. A defragment() pass that was to resume at the node resumes after it instead.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::nodeUnlinking(AVLNode<Key, Value>* node)
+{
+    if (size_ != kUnknownSize) size_--;
+    if (node == defragNext_) defragNext_ = successor(node);
+    if (node == min_)
+    {
+        min_ = node->getRight();
+        if (!min_) min_ = node->getParent();
+        else while (min_->getLeft()) min_ = min_->getLeft();
+    }
+    if (node == max_)
+    {
+        max_ = node->getLeft();
+        if (!max_) max_ = node->getParent();
+        else while (max_->getRight()) max_ = max_->getRight();
+    }
+}
+
+// Finds the extremes of a new root_ along its spines in O(log n) and records its size.
+// A defragment() pass in progress starts over, since its position may have left the tree
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::resetCache(size_t size)
+{
+    size_ = size;
+    defragNext_ = NULL;
+    min_ = max_ = static_cast<AVLNode<Key, Value>*>(this->root_);
+    if (!min_) return;
+    while (min_->getLeft()) min_ = min_->getLeft();
+    while (max_->getRight()) max_ = max_->getRight();
+}
+
+/**
+* Incremental defragmentation. Nodes allocated one at a time end up scattered over the heap,
+* so scans and searches jump between unrelated cache lines and pages. Each call visits at
+* most budget nodes in key order, continuing where the previous call stopped, and copies
+* every node that is not already laid out after its predecessor into the AVLNodeChunk being
+* filled. The copy is linked in place of the original, which is freed, so after a full pass
+* the tree sits in 64 KiB chunks in key order and the next pass moves next to nothing.
+* The tree may be changed freely between calls; operations that rebuild it wholesale
+* (batches, split, join, clear) start the pass over. Returns true once a pass is complete.
+* A moved node has a new address, so iterators and cursors on the nodes moved by a call are
+* invalidated. Nodes of a tree with its own node type only move if it overrides relocateNode().
+*/
+template<class Key, class Value, class Balance>
+bool AVLTree<Key, Value, Balance>::defragment(size_t budget)
+{
+    if (!defragNext_) defragLast_ = NULL; // A new pass
+    AVLNode<Key, Value>* node = defragNext_ ? defragNext_ : min_;
+    for (; node && budget > 0; budget--)
+    {
+        AVLNode<Key, Value>* next = successor(node);
+        if (!laidOut(node, defragLast_))
+        {
+            AVLNode<Key, Value>* moved = relocateNode(node);
+            if (moved)
+            {
+                replaceNode(node, moved);
+                node = moved;
+            }
+        }
+        defragLast_ = node;
+        node = next;
+    }
+    defragNext_ = node;
+    return !node;
+}
+
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::relocateNode(AVLNode<Key, Value>* node)
+{
+    if (typeid(*node) != typeid(AVLNode<Key, Value>)) return NULL; // Only the tree that made it knows how to move a subclass node
+    void* memory = relocationMemory(sizeof(AVLNode<Key, Value>), alignof(AVLNode<Key, Value>));
+    if (!memory) return NULL;
+    return new (memory) AVLNode<Key, Value>(std::move(*node));
+}
+
+// Takes size bytes from the chunk being filled, starting a new chunk when it is full. Returns NULL for nodes that fit in no chunk
+template<class Key, class Value, class Balance>
+void* AVLTree<Key, Value, Balance>::relocationMemory(size_t size, size_t alignment)
+{
+    if (sizeof(AVLNodeChunk) + alignment + size > AVLNodeChunk::kBytes) return NULL;
+    void* memory = defragChunk_ ? defragChunk_->allocate(size, alignment) : NULL;
+    if (memory) return memory;
+    AVLNodeChunk* chunk = AVLNodeChunk::create();
+    if (!chunk) return NULL;
+    if (defragChunk_) defragChunk_->release();
+    defragChunk_ = chunk;
+    return chunk->allocate(size, alignment);
+}
+
+// Links moved, which relocateNode() made from node, where node is in the tree and frees node
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::replaceNode(AVLNode<Key, Value>* node, AVLNode<Key, Value>* moved)
+{
+    moved->setInChunk(true);
+    AVLNode<Key, Value>* parent = node->getParent();
+    if (!parent) this->root_ = moved;
+    else if (parent->getLeft() == node) parent->setLeft(moved);
+    else parent->setRight(moved);
+    if (moved->getLeft()) moved->getLeft()->setParent(moved);
+    if (moved->getRight()) moved->getRight()->setParent(moved);
+    if (min_ == node) min_ = moved;
+    if (max_ == node) max_ = moved;
+    delete node;
+}
+
+/**
+* Whether a pass can leave node where it is: in a chunk, either right after previous (the
+* node before it in key order) or as the first node of its chunk. The second case keeps a
+* pass over an already defragmented tree from moving everything after a chunk boundary.
+*/
+template<class Key, class Value, class Balance>
+bool AVLTree<Key, Value, Balance>::laidOut(const AVLNode<Key, Value>* node, const void* previous)
+{
+    if (!node->isInChunk()) return false;
+    const AVLNodeChunk* chunk = AVLNodeChunk::of(node);
+    if (chunk->first == node) return true;
+    return AVLNodeChunk::of(previous) == chunk && reinterpret_cast<uintptr_t>(previous) < reinterpret_cast<uintptr_t>(node);
+}
+
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::successor(AVLNode<Key, Value>* node)
+{
+    if (node->getRight())
+    {
+        node = node->getRight();
+        while (node->getLeft()) node = node->getLeft(); // Go all the way left
+        return node;
+    }
+    AVLNode<Key, Value>* parent = node->getParent();
+    while (parent && parent->getRight() == node) // Climb until we come up from a left child
+    {
+        node = parent;
+        parent = parent->getParent();
+    }
+    return parent;
+}
+
+/**
+* Takes a node out of the tree and rebalances, without freeing it. The node is returned
+* detached (no parent or children) so it can be freed or linked into a tree again.
+*/
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::unlinkNode(AVLNode<Key, Value>* findRes)
+{
+    nodeUnlinking(findRes);
+    AVLNode<Key, Value>* parent = static_cast<AVLNode<Key, Value>*>(findRes->getParent());
+    AVLNode<Key, Value>* predParent = NULL;
+    if (!findRes->getLeft() && !findRes->getRight()) // Leaf node
+    {
+        if (parent) // If findRes is not root (i.e. parent is not NULL)
+        {
+            // Find out which direction is the node and unlink it
+            if (parent->getLeft() == findRes) parent->setLeft(NULL);
+            else parent->setRight(NULL);
+        }
+        else this->root_ = NULL; // If we are removing the root, set it to NULL
+    }
+    else if ((findRes->getLeft() == NULL) != (findRes->getRight() == NULL)) // 1 child
+    {
+        AVLNode<Key, Value>* child = findRes->getLeft() ? findRes->getLeft() : findRes->getRight();
+        if (parent) // If findRes is not root (i.e. parent is not NULL)
+        {
+            // Find out which direction is the child and promote it
+            if (parent->getLeft() == findRes) parent->setLeft(child);
+            else parent->setRight(child);
+            child->setParent(parent);
+        }
+        else // If we are removing root with only one child, promote the child as the new root
+        {
+            child->setParent(NULL);
+            this->root_ = child;
+        }
+    }
+    else // 2 children
+    {
+        // If there are 2 children, swap the node with predecessor and unlink it
+        AVLNode<Key, Value>* predecessor = static_cast<AVLNode<Key, Value>*>(this->predecessor(findRes));
+        nodeSwap(findRes, predecessor); // Now findRes is predecessor, predecessor is findRes
+        predParent = findRes->getParent();
+        // Unlink the node after swap. Furthermore, after swap, it mustn't be the root. So no need to detect root anymore
+        // To be a predecessor, a node must only have 0 or 1 child. So only need to consider these 2 cases
+        // Copy the code from above
+        if (!findRes->getLeft() && !findRes->getRight()) // Leaf node
+        {
+            if (predParent->getLeft() == findRes) predParent->setLeft(NULL);
+            else predParent->setRight(NULL);
+        }
+        else if ((findRes->getLeft() == NULL) != (findRes->getRight() == NULL)) // 1 child
+        {
+            AVLNode<Key, Value>* child = findRes->getLeft() ? findRes->getLeft() : findRes->getRight();
+            if (predParent->getLeft() == findRes) predParent->setLeft(child);
+            else predParent->setRight(child);
+            child->setParent(predParent);
+        }
+    }
+    findRes->setParent(NULL);
+    findRes->setLeft(NULL);
+    findRes->setRight(NULL);
+    findRes->setHeight(1);
+
+    // Begin AVL-specific remove implementation
+    rebalanceAfterRemove(predParent ? predParent : parent); // The start node may be swapped, so need to determine
+    return findRes;
+}
+
+/**
+* Retraces from the parent of an unlinked node. Unlike insertion, every ancestor may need a
+* rotation, but once a subtree comes out (after any rotation) as tall as it was before the
+* removal, nothing above it can have changed, so the retracing stops there. Removals at the
+* ends of the tree, as with pop_min(), mostly stop within a level or two of the leaf.
+* Per-subtree data kept by subclasses still has to be refreshed up to the root.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::rebalanceAfterRemove(AVLNode<Key, Value>* start)
+{
+    if (bulk_) return;
+    if (Balance::kRankBalanced)
+    {
+        rankRebalanceAfterRemove(start);
+        return;
+    }
+    AVLNode<Key, Value>* temp = start;
+    while (temp)
+    {
+        int oldHeight = temp->getHeight(); // Ancestors still have their heights from before the removal
+        updateNode(temp);
+        if (calculateBF(temp) > Balance::kSlack) temp = restructure(temp);
+        if (temp->getHeight() == oldHeight) break;
+        temp = temp->getParent();
+    }
+    if (temp && keepsSubtreeData()) updateHeights(temp->getParent());
+}
+
+/**
+* Links a detached node into the tree and rebalances. If its key is already present nothing
+* is linked and the node already holding the key is returned, otherwise newNode is returned.
+*/
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::linkNode(AVLNode<Key, Value>* newNode)
+{
+    newNode->setHeight(1); // It is a leaf now, whatever it was before
+    updateNode(newNode);
+    if (bulk_ && bulkLink(newNode)) return newNode;
+    if (!this->root_)
+    {
+        this->root_ = newNode;
+        nodeLinked(newNode);
+        return newNode;
+    }
+    AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->root_);
+    AVLNode<Key, Value>* parent = NULL;
+    bool lastDirection = false; // false means left, true means right
+    while (node)
+    {
+        parent = node;
+        if (newNode->getKey() < node->getKey()) // If smaller, go left
+        {
+            node = node->getLeft();
+            lastDirection = false;
+        }
+        else if (newNode->getKey() == node->getKey()) return node; // Key taken, leave newNode alone
+        else // If larger, go right
+        {
+            node = node->getRight();
+            lastDirection = true;
+        }
+    }
+    newNode->setParent(parent);
+    if (lastDirection) parent->setRight(newNode);
+    else parent->setLeft(newNode);
+    nodeLinked(newNode);
+    rebalanceAfterInsert(parent);
+    return newNode;
+}
+
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
+{
+    BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
     int tempH = n1->getHeight();
     n1->setHeight(n2->getHeight());
     n2->setHeight(tempH);
 }
 
+template<class Key, class Value, class Balance>
+int AVLTree<Key, Value, Balance>::height(AVLNode<Key, Value>* node)
+{
+    return node ? node->getHeight() : 0;
+}
+
+/**
+* Joins two AVL subtrees and a middle node into one AVL subtree, given that every key in left
+* is smaller than middle's key and every key in right is larger. If the heights are close
+* the middle node simply becomes the root, otherwise it is hung off the spine of the taller
+* side at the right height and the spine is rebalanced on the way back up.
+* This takes O(|height(left) - height(right)|) time.
+*/
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::join(AVLNode<Key, Value>* left, AVLNode<Key, Value>* middle, AVLNode<Key, Value>* right)
+{
+    AVLNode<Key, Value>* root;
+    if (height(left) > height(right) + 1) root = joinRight(left, middle, right);
+    else if (height(right) > height(left) + 1) root = joinLeft(left, middle, right);
+    else
+    {
+        middle->setLeft(left);
+        middle->setRight(right);
+        if (left) left->setParent(middle);
+        if (right) right->setParent(middle);
+        updateNode(middle);
+        root = middle;
+    }
+    root->setParent(NULL);
+    return root;
+}
+
+// Helper function for join() when left is the taller side: walk down left's right spine
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::joinRight(AVLNode<Key, Value>* left, AVLNode<Key, Value>* middle, AVLNode<Key, Value>* right)
+{
+    AVLNode<Key, Value>* child = left->getRight();
+    if (height(child) <= height(right) + 1) // Found the place to hang middle
+    {
+        middle->setLeft(child);
+        middle->setRight(right);
+        if (child) child->setParent(middle);
+        if (right) right->setParent(middle);
+        updateNode(middle);
+        left->setRight(middle);
+        middle->setParent(left);
+        if (height(middle) <= height(left->getLeft()) + 1)
+        {
+            updateNode(left);
+            return left;
+        }
+        // middle ended up 2 taller than its sibling and its left side is the tall one, so zigzag
+        rightRotate(middle);
+        updateNode(middle);
+        updateNode(child);
+        leftRotate(left);
+        updateNode(left);
+        updateNode(child);
+        return child;
+    }
+    AVLNode<Key, Value>* subtree = joinRight(child, middle, right);
+    left->setRight(subtree);
+    subtree->setParent(left);
+    if (height(subtree) <= height(left->getLeft()) + 1)
+    {
+        updateNode(left);
+        return left;
+    }
+    // The right side grew 2 taller than the left, a single rotation fixes it
+    leftRotate(left);
+    updateNode(left);
+    updateNode(subtree);
+    return subtree;
+}
+
+// Mirror image of joinRight() for when right is the taller side
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::joinLeft(AVLNode<Key, Value>* left, AVLNode<Key, Value>* middle, AVLNode<Key, Value>* right)
+{
+    AVLNode<Key, Value>* child = right->getLeft();
+    if (height(child) <= height(left) + 1)
+    {
+        middle->setLeft(left);
+        middle->setRight(child);
+        if (left) left->setParent(middle);
+        if (child) child->setParent(middle);
+        updateNode(middle);
+        right->setLeft(middle);
+        middle->setParent(right);
+        if (height(middle) <= height(right->getRight()) + 1)
+        {
+            updateNode(right);
+            return right;
+        }
+        leftRotate(middle);
+        updateNode(middle);
+        updateNode(child);
+        rightRotate(right);
+        updateNode(right);
+        updateNode(child);
+        return child;
+    }
+    AVLNode<Key, Value>* subtree = joinLeft(left, middle, child);
+    right->setLeft(subtree);
+    subtree->setParent(right);
+    if (height(subtree) <= height(right->getRight()) + 1)
+    {
+        updateNode(right);
+        return right;
+    }
+    rightRotate(right);
+    updateNode(right);
+    updateNode(subtree);
+    return subtree;
+}
+
+/**
+* Joins two subtrees without a middle node by taking the largest node of left as the middle.
+*/
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::join2(AVLNode<Key, Value>* left, AVLNode<Key, Value>* right)
+{
+    if (!left) return right;
+    if (!right) return left;
+    AVLNode<Key, Value>* rest = NULL;
+    AVLNode<Key, Value>* last = NULL;
+    splitLast(left, rest, last);
+    return join(rest, last, right);
+}
+
+// Helper function for join2(): detaches the largest node of a subtree
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::splitLast(AVLNode<Key, Value>* node, AVLNode<Key, Value>*& rest, AVLNode<Key, Value>*& last)
+{
+    AVLNode<Key, Value>* leftChild = node->getLeft();
+    if (leftChild) leftChild->setParent(NULL);
+    if (!node->getRight())
+    {
+        rest = leftChild;
+        last = node;
+        node->setLeft(NULL);
+        return;
+    }
+    AVLNode<Key, Value>* rightChild = node->getRight();
+    rightChild->setParent(NULL);
+    AVLNode<Key, Value>* rightRest = NULL;
+    splitLast(rightChild, rightRest, last);
+    rest = join(leftChild, node, rightRest);
+}
+
+/**
+* Splits a detached subtree by key into a subtree of smaller keys, the node holding key (or
+* NULL if there is none) and a subtree of larger keys. Every node on the search path is
+* rejoined into one of the two sides, which takes O(log n) time in total.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::split(AVLNode<Key, Value>* node, const Key& key, AVLNode<Key, Value>*& left, AVLNode<Key, Value>*& found, AVLNode<Key, Value>*& right)
+{
+    if (!node)
+    {
+        left = found = right = NULL;
+        return;
+    }
+    AVLNode<Key, Value>* leftChild = node->getLeft();
+    AVLNode<Key, Value>* rightChild = node->getRight();
+    if (leftChild) leftChild->setParent(NULL);
+    if (rightChild) rightChild->setParent(NULL);
+    if (key == node->getKey())
+    {
+        left = leftChild;
+        right = rightChild;
+        found = node;
+        node->setLeft(NULL);
+        node->setRight(NULL);
+        node->setParent(NULL);
+        node->setHeight(1);
+    }
+    else if (key < node->getKey())
+    {
+        AVLNode<Key, Value>* middle = NULL;
+        split(leftChild, key, left, found, middle);
+        right = join(middle, node, rightChild);
+    }
+    else
+    {
+        AVLNode<Key, Value>* middle = NULL;
+        split(rightChild, key, middle, found, right);
+        left = join(leftChild, node, middle);
+    }
+}
+
+/**
+* Builds a perfectly balanced subtree out of sorted, duplicate-free items in O(count) time,
+* building the two halves in parallel for the top depth levels.
+*/
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::buildBalanced(const std::pair<Key, Value>* items, size_t count, int depth)
+{
+    if (count == 0) return NULL;
+    size_t mid = count / 2;
+    AVLNode<Key, Value>* node = createNode(items[mid].first, items[mid].second, NULL);
+    AVLNode<Key, Value>* left = NULL;
+    AVLNode<Key, Value>* right = NULL;
+    parallelInvoke(depth > 0 && count >= kParallelGrain,
+        [&]() { left = buildBalanced(items, mid, depth - 1); },
+        [&]() { right = buildBalanced(items + mid + 1, count - mid - 1, depth - 1); });
+    node->setLeft(left);
+    node->setRight(right);
+    if (left) left->setParent(node);
+    if (right) right->setParent(node);
+    node->setHeight(std::max(height(left), height(right)) + 1); // Set directly, so WAVL ranks come out right too
+    updateNode(node);
+    return node;
+}
+
+/**
+* Merges sorted, duplicate-free items into a detached subtree. The subtree is split around
+* the middle item, both halves are merged recursively (in parallel, since they share no
+* nodes) and joined back with the middle item's node. An existing key gets its value
+* updated in place, like insert(). added is increased by the number of new keys.
+*/
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::unionBatch(AVLNode<Key, Value>* node, const std::pair<Key, Value>* items, size_t count, int depth, size_t& added)
+{
+    if (count == 0) return node;
+    if (!node)
+    {
+        added += count;
+        return buildBalanced(items, count, depth);
+    }
+    size_t mid = count / 2;
+    AVLNode<Key, Value>* left = NULL;
+    AVLNode<Key, Value>* found = NULL;
+    AVLNode<Key, Value>* right = NULL;
+    split(node, items[mid].first, left, found, right);
+    size_t leftAdded = 0; // Separate counters, the halves may run on different threads
+    size_t rightAdded = 0;
+    parallelInvoke(depth > 0 && count >= kParallelGrain,
+        [&]() { left = unionBatch(left, items, mid, depth - 1, leftAdded); },
+        [&]() { right = unionBatch(right, items + mid + 1, count - mid - 1, depth - 1, rightAdded); });
+    added += leftAdded + rightAdded;
+    if (found) found->setValue(items[mid].second);
+    else
+    {
+        found = createNode(items[mid].first, items[mid].second, NULL);
+        added++;
+    }
+    return join(left, found, right);
+}
+
+/**
+* Removes sorted, duplicate-free keys from a detached subtree, the same way as unionBatch().
+* removed is increased by the number of keys that were found.
+*/
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::differenceBatch(AVLNode<Key, Value>* node, const Key* keys, size_t count, int depth, size_t& removed)
+{
+    if (count == 0 || !node) return node;
+    size_t mid = count / 2;
+    AVLNode<Key, Value>* left = NULL;
+    AVLNode<Key, Value>* found = NULL;
+    AVLNode<Key, Value>* right = NULL;
+    split(node, keys[mid], left, found, right);
+    if (found) removed++;
+    delete found;
+    size_t leftRemoved = 0;
+    size_t rightRemoved = 0;
+    parallelInvoke(depth > 0 && count >= kParallelGrain,
+        [&]() { left = differenceBatch(left, keys, mid, depth - 1, leftRemoved); },
+        [&]() { right = differenceBatch(right, keys + mid + 1, count - mid - 1, depth - 1, rightRemoved); });
+    removed += leftRemoved + rightRemoved;
+    return join2(left, right);
+}
+
+/**
+* Inserts a batch of key/value pairs at once. The batch is sorted (a later pair wins over an
+* earlier one with the same key, as with repeated insert() calls) and merged into the tree
+* with split/join, so each region of the tree is rebalanced once instead of once per key.
+* Independent subtrees are merged on up to threads threads (0 means one per hardware thread).
+* Runs in O(m log(n/m + 1)) work for a batch of m keys.
+*/
+template<class Key, class Value, class Balance>
+template<typename InputIt>
+void AVLTree<Key, Value, Balance>::insert_batch(InputIt first, InputIt last, unsigned threads)
+{
+    std::vector<std::pair<Key, Value> > items;
+    sortBatch(first, last, parallelDepth(threads), items);
+    if (items.empty()) return;
+    if (!joinable())
+    {
+        for (size_t i = 0; i < items.size(); i++) insert(items[i]);
+        return;
+    }
+    AVLNode<Key, Value>* root = static_cast<AVLNode<Key, Value>*>(this->root_);
+    size_t added = 0;
+    this->root_ = unionBatch(root, &items[0], items.size(), parallelDepth(threads), added);
+    resetCache(size_ == kUnknownSize ? kUnknownSize : size_ + added);
+}
+
+/**
+* Replaces the contents of the tree with an unsorted range of key/value pairs. Equal keys
+* resolve like repeated insert() calls, the last one wins. The range is sorted on up to
+* threads threads and the nodes are then built straight into a perfectly balanced tree, both
+* halves of each subtree in parallel, so no rebalancing is done at all. This works under
+* every balancing policy.
+*/
+template<class Key, class Value, class Balance>
+template<typename InputIt>
+void AVLTree<Key, Value, Balance>::assign(InputIt first, InputIt last, unsigned threads)
+{
+    std::vector<std::pair<Key, Value> > items;
+    int depth = parallelDepth(threads);
+    sortBatch(first, last, depth, items);
+    this->clear();
+    if (items.empty()) return;
+    this->root_ = buildBalanced(&items[0], items.size(), depth);
+    resetCache(items.size());
+}
+
+/**
+* Copies a batch into items sorted by key, keeping only the last pair of each run of equal
+* keys. The sort is stable, so that is the pair that came last in the batch.
+*/
+template<class Key, class Value, class Balance>
+template<typename InputIt>
+void AVLTree<Key, Value, Balance>::sortBatch(InputIt first, InputIt last, int depth, std::vector<std::pair<Key, Value> >& items)
+{
+    items.assign(first, last);
+    parallelStableSort(items.begin(), items.end(),
+        [](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) { return a.first < b.first; }, depth);
+    size_t kept = 0;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        if (i + 1 < items.size() && items[i].first == items[i + 1].first) continue;
+        if (kept != i) items[kept] = std::move(items[i]);
+        kept++;
+    }
+    items.erase(items.begin() + kept, items.end());
+}
+
+/**
+* Removes a batch of keys at once, with the same split/join approach as insert_batch().
+* Keys that are not in the tree are ignored.
+*/
+template<class Key, class Value, class Balance>
+template<typename InputIt>
+void AVLTree<Key, Value, Balance>::remove_batch(InputIt first, InputIt last, unsigned threads)
+{
+    std::vector<Key> keys(first, last);
+    if (keys.empty() || !this->root_) return;
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    if (!joinable())
+    {
+        for (size_t i = 0; i < keys.size(); i++) remove(keys[i]);
+        return;
+    }
+    AVLNode<Key, Value>* root = static_cast<AVLNode<Key, Value>*>(this->root_);
+    size_t removed = 0;
+    this->root_ = differenceBatch(root, &keys[0], keys.size(), parallelDepth(threads), removed);
+    resetCache(size_ == kUnknownSize ? kUnknownSize : size_ - removed);
+}
+
+/**
+* Splits the tree in O(log n): keys smaller than key stay, the rest move into upper.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::split_at(const Key& key, AVLTree<Key, Value, Balance>& upper)
+{
+    if (!upper.empty()) throw std::invalid_argument("AVLTree::split_at: the upper tree must be empty");
+    if (!joinable() || !upper.joinable())
+    {
+        upper.moveNodes(*this, this->lower_bound(key));
+        return;
+    }
+    AVLNode<Key, Value>* left = NULL;
+    AVLNode<Key, Value>* found = NULL;
+    AVLNode<Key, Value>* right = NULL;
+    split(static_cast<AVLNode<Key, Value>*>(this->root_), key, left, found, right);
+    if (found) right = join(NULL, found, right); // key itself belongs to the upper part
+    this->root_ = left;
+    upper.root_ = right;
+    resetCache(kUnknownSize);
+    upper.resetCache(kUnknownSize);
+}
+
+/**
+* Concatenates two trees with disjoint key ranges in O(log n), in whichever order they go.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::concat(AVLTree<Key, Value, Balance>& other)
+{
+    if (&other == this || other.empty()) return;
+    AVLNode<Key, Value>* mine = static_cast<AVLNode<Key, Value>*>(this->root_);
+    AVLNode<Key, Value>* theirs = static_cast<AVLNode<Key, Value>*>(other.root_);
+    if (mine)
+    {
+        AVLNode<Key, Value>* myMax = mine;
+        while (myMax->getRight()) myMax = myMax->getRight();
+        AVLNode<Key, Value>* theirMin = theirs;
+        while (theirMin->getLeft()) theirMin = theirMin->getLeft();
+        if (!(myMax->getKey() < theirMin->getKey()))
+        {
+            AVLNode<Key, Value>* theirMax = theirs;
+            while (theirMax->getRight()) theirMax = theirMax->getRight();
+            AVLNode<Key, Value>* myMin = mine;
+            while (myMin->getLeft()) myMin = myMin->getLeft();
+            if (!(theirMax->getKey() < myMin->getKey())) throw std::invalid_argument("AVLTree::concat: key ranges overlap");
+            std::swap(mine, theirs); // other's keys come first
+        }
+    }
+    if (!joinable() || !other.joinable())
+    {
+        moveNodes(other, other.begin());
+        return;
+    }
+    size_t total = size_ == kUnknownSize || other.size_ == kUnknownSize ? kUnknownSize : size_ + other.size_;
+    this->root_ = join2(mine, theirs);
+    other.root_ = NULL;
+    resetCache(total);
+    other.resetCache(0);
+}
+
+/**
+* Unlinks the node holding key and hands it over, or returns an empty handle if key is missing.
+*/
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::node_type AVLTree<Key, Value, Balance>::extract(const Key& key)
+{
+    AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->internalFind(key));
+    if (!node) return node_type();
+    return node_type(unlinkNode(node), &typeid(*this));
+}
+
+/**
+* Unlinks the node at position, which must be a valid iterator into this tree.
+*/
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::node_type AVLTree<Key, Value, Balance>::extract(iterator position)
+{
+    AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->nodeOf(position));
+    return node_type(unlinkNode(node), &typeid(*this));
+}
+
+/**
+* Links the node owned by handle into the tree, reusing its allocation, and returns an
+* iterator to it. If the key is already present nothing changes: the handle keeps its node
+* and the returned iterator points to the existing entry. Handles can only move between
+* trees of the same type, since other trees may use a different node type.
+*/
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::iterator AVLTree<Key, Value, Balance>::insert(node_type&& handle)
+{
+    if (handle.empty()) return this->end();
+    if (*handle.treeType_ != typeid(*this)) throw std::invalid_argument("AVLTree::insert: node handle comes from a different kind of tree");
+    AVLNode<Key, Value>* node = linkNode(handle.node_);
+    if (node == handle.node_) handle.node_ = NULL; // The tree owns it now
+    return this->makeIterator(node);
+}
+
+/**
+* Re-keys the entry owned by handle: links a new node holding key and a copy of the handle's
+* value, then frees the handle's node. Keys are const inside nodes, so this is the one case
+* that allocates. If key is already present nothing changes, as with insert(node_type&&).
+*/
+template<class Key, class Value, class Balance>
+typename AVLTree<Key, Value, Balance>::iterator AVLTree<Key, Value, Balance>::insert(node_type&& handle, const Key& key)
+{
+    if (handle.empty()) return this->end();
+    if (*handle.treeType_ != typeid(*this)) throw std::invalid_argument("AVLTree::insert: node handle comes from a different kind of tree");
+    AVLNode<Key, Value>* newNode = createNode(key, handle.node_->getValue(), NULL);
+    AVLNode<Key, Value>* node = linkNode(newNode);
+    if (node != newNode)
+    {
+        delete newNode; // Key taken, the handle keeps its node
+        return this->makeIterator(node);
+    }
+    delete handle.node_;
+    handle.node_ = NULL;
+    return this->makeIterator(node);
+}
+
+/**
+* Moves every node of other whose key is not in this tree over, relinking the nodes instead
+* of copying them. Entries with keys already present here stay in other.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::merge(AVLTree<Key, Value, Balance>& other)
+{
+    if (&other == this) return;
+    if (typeid(other) != typeid(*this)) throw std::invalid_argument("AVLTree::merge: trees are of different kinds");
+    iterator it = other.begin();
+    while (it != other.end())
+    {
+        AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->nodeOf(it));
+        ++it; // Unlinking moves other nodes around but never frees them, so it stays valid
+        if (!this->internalFind(node->getKey())) linkNode(other.unlinkNode(node));
+    }
+}
+
+template<class Key, class Value, class Balance>
+size_t AVLTree<Key, Value, Balance>::freeSubtree(AVLNode<Key, Value>* node)
+{
+    size_t count = 0;
+    std::vector<AVLNode<Key, Value>*> stack; // Explicit stack, the subtree can be large
+    if (node) stack.push_back(node);
+    while (!stack.empty())
+    {
+        node = stack.back();
+        stack.pop_back();
+        if (node->getLeft()) stack.push_back(node->getLeft());
+        if (node->getRight()) stack.push_back(node->getRight());
+        delete node;
+        count++;
+    }
+    return count;
+}
+
+/**
+* Removes every key with lo <= key < hi and returns how many were removed. Rather than one
+* remove() per key, the range is cut out with two splits, the remaining two parts are
+* joined and the cut out subtree is freed in one sweep, which is O(log n + k) in total.
+*/
+template<class Key, class Value, class Balance>
+size_t AVLTree<Key, Value, Balance>::erase(const Key& lo, const Key& hi)
+{
+    if (!(lo < hi) || !this->root_) return 0;
+    if (!joinable()) return eraseNodes(this->lower_bound(lo), this->lower_bound(hi));
+    AVLNode<Key, Value>* left = NULL;
+    AVLNode<Key, Value>* found = NULL;
+    AVLNode<Key, Value>* rest = NULL;
+    split(static_cast<AVLNode<Key, Value>*>(this->root_), lo, left, found, rest);
+    if (found) rest = join(NULL, found, rest); // lo itself is in the range
+    AVLNode<Key, Value>* middle = NULL;
+    AVLNode<Key, Value>* right = NULL;
+    split(rest, hi, middle, found, right);
+    if (found) right = join(NULL, found, right); // hi itself is not
+    this->root_ = join2(left, right);
+    size_t removed = freeSubtree(middle);
+    resetCache(size_ == kUnknownSize ? kUnknownSize : size_ - removed);
+    return removed;
+}
+
+/**
+* Removes the items in [first, last), the iterator form of erase(lo, hi).
+*/
+template<class Key, class Value, class Balance>
+size_t AVLTree<Key, Value, Balance>::erase(iterator first, iterator last)
+{
+    if (first == last) return 0;
+    if (!joinable()) return eraseNodes(first, last);
+    Key lo = first->first;
+    if (last != this->end()) return erase(lo, Key(last->first));
+    // Everything from first on goes
+    AVLNode<Key, Value>* left = NULL;
+    AVLNode<Key, Value>* found = NULL;
+    AVLNode<Key, Value>* right = NULL;
+    split(static_cast<AVLNode<Key, Value>*>(this->root_), lo, left, found, right);
+    if (found) right = join(NULL, found, right);
+    this->root_ = left;
+    size_t removed = freeSubtree(right);
+    resetCache(size_ == kUnknownSize ? kUnknownSize : size_ - removed);
+    return removed;
+}
+
+/**
+* Removes the items in [first, last) one remove at a time.
+*/
+template<class Key, class Value, class Balance>
+size_t AVLTree<Key, Value, Balance>::eraseNodes(iterator first, iterator last)
+{
+    size_t count = 0;
+    while (first != last)
+    {
+        AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->nodeOf(first));
+        ++first; // Unlinking moves other nodes around but never frees them, so first and last stay valid
+        delete unlinkNode(node);
+        count++;
+    }
+    return count;
+}
+
+/**
+* Moves every node of from, starting at first, into this tree one link at a time.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::moveNodes(AVLTree<Key, Value, Balance>& from, iterator first)
+{
+    while (first != from.end())
+    {
+        AVLNode<Key, Value>* node = static_cast<AVLNode<Key, Value>*>(this->nodeOf(first));
+        ++first;
+        linkNode(from.unlinkNode(node));
+    }
+}
+
+/**
+* The single or double rotation of balance(), but only z, y and x get their heights updated,
+* bottom-up, so the caller decides how far up to retrace.
+*/
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::restructure(AVLNode<Key, Value>* z)
+{
+    AVLNode<Key, Value>* x = NULL;
+    AVLNode<Key, Value>* y = NULL;
+    AVLNode<Key, Value>* start = z;
+    int balanceMode = findXYZ(x, y, z, start);
+    AVLNode<Key, Value>* root = balanceMode == 1 || balanceMode == 2 ? y : x;
+    if (balanceMode == 1) leftRotate(z);
+    else if (balanceMode == 2) rightRotate(z);
+    else if (balanceMode == 3)
+    {
+        leftRotate(y);
+        rightRotate(z);
+    }
+    else
+    {
+        rightRotate(y);
+        leftRotate(z);
+    }
+    if (z == this->root_) this->root_ = root;
+    updateNode(z);
+    if (root == x) updateNode(y);
+    updateNode(root);
+    return root;
+}
+
+template<class Key, class Value, class Balance>
+bool AVLTree<Key, Value, Balance>::keepsSubtreeData() const
+{
+    return false;
+}
+
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::rotateUp(AVLNode<Key, Value>* node)
+{
+    AVLNode<Key, Value>* parent = node->getParent();
+    if (parent->getLeft() == node) rightRotate(parent);
+    else leftRotate(parent);
+    if (this->root_ == parent) this->root_ = node;
+}
+
+/**
+* WAVL insertion. The new leaf (rank 1) may be a 0-child, i.e. have the same rank as its
+* parent. While the parent's other child is a 1-child the parent is promoted, which moves
+* the problem up a level. Otherwise one single or double rotation ends it.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::rankRebalanceAfterInsert(AVLNode<Key, Value>* parent)
+{
+    while (parent)
+    {
+        int rank = height(parent);
+        AVLNode<Key, Value>* child = NULL; // The 0-child, if there is one
+        if (parent->getLeft() && height(parent->getLeft()) == rank) child = parent->getLeft();
+        else if (parent->getRight() && height(parent->getRight()) == rank) child = parent->getRight();
+        if (!child) return; // Every rank difference is 1 or 2 again
+        bool childLeft = parent->getLeft() == child;
+        AVLNode<Key, Value>* sibling = childLeft ? parent->getRight() : parent->getLeft();
+        if (rank - height(sibling) == 1) // 0,1 node: promote and go up
+        {
+            parent->setHeight(rank + 1);
+            parent = parent->getParent();
+            continue;
+        }
+        // 0,2 node: child was just promoted, so one of its children is a 1-child and the other a 2-child
+        AVLNode<Key, Value>* inner = childLeft ? child->getRight() : child->getLeft();
+        if (height(child) - height(inner) == 2) // The 1-child is on the outside, single rotation
+        {
+            rotateUp(child);
+            parent->setHeight(rank - 1);
+        }
+        else // Double rotation
+        {
+            rotateUp(inner);
+            rotateUp(inner);
+            inner->setHeight(height(inner) + 1);
+            child->setHeight(height(child) - 1);
+            parent->setHeight(rank - 1);
+        }
+        return;
+    }
+}
+
+/**
+* WAVL removal, starting at the parent of the unlinked position. That node may now be a
+* 2,2 leaf or have a 3-child. Demotions move the problem up a level; otherwise one single
+* or double rotation ends it.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::rankRebalanceAfterRemove(AVLNode<Key, Value>* parent)
+{
+    while (parent)
+    {
+        int rank = height(parent);
+        AVLNode<Key, Value>* left = parent->getLeft();
+        AVLNode<Key, Value>* right = parent->getRight();
+        if (!left && !right)
+        {
+            if (rank == 1) return;
+            parent->setHeight(1); // 2,2 leaf: demote
+            parent = parent->getParent();
+            continue;
+        }
+        if (rank - height(left) <= 2 && rank - height(right) <= 2) return;
+        // The sibling of the 3-child has rank at least 1, so it exists
+        AVLNode<Key, Value>* sibling = rank - height(left) == 3 ? right : left;
+        int siblingRank = height(sibling);
+        if (rank - siblingRank == 2) // Sibling is a 2-child: demote
+        {
+            parent->setHeight(rank - 1);
+            parent = parent->getParent();
+            continue;
+        }
+        if (siblingRank - height(sibling->getLeft()) == 2 && siblingRank - height(sibling->getRight()) == 2) // Sibling is 2,2: demote both
+        {
+            parent->setHeight(rank - 1);
+            sibling->setHeight(siblingRank - 1);
+            parent = parent->getParent();
+            continue;
+        }
+        bool siblingLeft = sibling == left;
+        AVLNode<Key, Value>* outer = siblingLeft ? sibling->getLeft() : sibling->getRight();
+        AVLNode<Key, Value>* inner = siblingLeft ? sibling->getRight() : sibling->getLeft();
+        if (siblingRank - height(outer) == 1) // Single rotation
+        {
+            rotateUp(sibling);
+            sibling->setHeight(siblingRank + 1);
+            // parent was 3,1 and is now 2,x, or a leaf which must have rank 1
+            parent->setHeight(!parent->getLeft() && !parent->getRight() ? 1 : rank - 1);
+        }
+        else // Double rotation
+        {
+            rotateUp(inner);
+            rotateUp(inner);
+            inner->setHeight(height(inner) + 2);
+            sibling->setHeight(siblingRank - 1);
+            parent->setHeight(rank - 2);
+        }
+        return;
+    }
+}
+
+/**
+* Starts bulk mode, for loading many keys when nothing needs to be fast until the load is
+* done. Inserts and removes then link and unlink nodes like a plain BST, with no height
+* updates and no rotations, and a key beyond either end of the tree is linked directly next
+* to the smallest or largest node, so ascending or descending input costs O(1) per key.
+* Everything stays correct in the meantime, only lookups may get slower as the tree drifts
+* out of balance. Split/join based operations fall back to one insert/remove per key.
+* Trees that keep per-subtree data (like AggregateAVLTree's summaries) ignore the call: every
+* change would have to refresh its ancestors, which in a tree drifting out of balance costs
+* up to O(n) per key, so they stay in normal mode and their queries stay exact.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::begin_bulk()
+{
+    if (keepsSubtreeData()) return;
+    bulk_ = true;
+}
+
+/**
+* Ends bulk mode by relinking every node into a perfectly balanced tree in O(n). The nodes
+* are already in key order, so nothing needs to be sorted or reallocated.
+*/
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::end_bulk()
+{
+    if (!bulk_) return;
+    bulk_ = false;
+    rebuildBalanced();
+}
+
+// Whether split/join can be used right now: it needs a policy that allows it and real heights
+template<class Key, class Value, class Balance>
+bool AVLTree<Key, Value, Balance>::joinable() const
+{
+    return Balance::kJoinable && !bulk_;
+}
+
+/**
+* The bulk mode fast path of insert(): inserts item with bulkLink() if it goes beyond either
+* end of the tree, otherwise returns false.
+*/
+template<class Key, class Value, class Balance>
+bool AVLTree<Key, Value, Balance>::bulkAppend(const std::pair<const Key, Value>& item)
+{
+    if (this->root_ && !(max_->getKey() < item.first) && !(item.first < min_->getKey())) return false;
+    bulkLink(createNode(item.first, item.second, NULL));
+    return true;
+}
+
+/**
+* Links a detached node as the root of an empty tree or right next to the smallest or
+* largest node if its key goes beyond them, in O(1). Returns false if the key belongs
+* somewhere inside the tree.
+*/
+template<class Key, class Value, class Balance>
+bool AVLTree<Key, Value, Balance>::bulkLink(AVLNode<Key, Value>* node)
+{
+    if (!this->root_) this->root_ = node;
+    else if (max_->getKey() < node->getKey())
+    {
+        node->setParent(max_);
+        max_->setRight(node);
+    }
+    else if (node->getKey() < min_->getKey())
+    {
+        node->setParent(min_);
+        min_->setLeft(node);
+    }
+    else return false;
+    nodeLinked(node);
+    return true;
+}
+
+template<class Key, class Value, class Balance>
+void AVLTree<Key, Value, Balance>::rebuildBalanced()
+{
+    std::vector<AVLNode<Key, Value>*> nodes;
+    for (iterator it = this->begin(); it != this->end(); ++it) nodes.push_back(static_cast<AVLNode<Key, Value>*>(this->nodeOf(it)));
+    if (nodes.empty()) return;
+    this->root_ = relinkBalanced(&nodes[0], nodes.size());
+    this->root_->setParent(NULL);
+}
+
+// Helper function for rebuildBalanced(), like buildBalanced() but with existing nodes
+template<class Key, class Value, class Balance>
+AVLNode<Key, Value>* AVLTree<Key, Value, Balance>::relinkBalanced(AVLNode<Key, Value>** nodes, size_t count)
+{
+    if (count == 0) return NULL;
+    size_t mid = count / 2;
+    AVLNode<Key, Value>* node = nodes[mid];
+    AVLNode<Key, Value>* left = relinkBalanced(nodes, mid);
+    AVLNode<Key, Value>* right = relinkBalanced(nodes + mid + 1, count - mid - 1);
+    node->setLeft(left);
+    node->setRight(right);
+    if (left) left->setParent(node);
+    if (right) right->setParent(node);
+    node->setHeight(std::max(height(left), height(right)) + 1); // Set directly, WAVL's updateNode() leaves ranks alone
+    updateNode(node);
+    return node;
+}
+
+/**
+* Calls f(item) on every entry, with item a std::pair<const Key, Value>&, like dereferencing
+* an iterator. The tree is cut at its upper levels into subtrees that are scanned on
+* separate threads, with the nodes above them visited by whichever thread takes their right
+* subtree, so f is called concurrently from several threads (on different entries) and must
+* be safe to call that way. Within each subtree entries are visited in key order.
+* The tree must not be changed during the scan. 0 threads means one per hardware thread.
+*/
+template<class Key, class Value, class Balance>
+template<typename F>
+void AVLTree<Key, Value, Balance>::parallel_for_each(F f, unsigned threads) const
+{
+    // Two levels more than there are threads. Forks past the hardware threads run inline, but
+    // once a thread that drew a small subtree (sibling heights may differ) is done, the
+    // pieces forked after that get its core
+    forEachHelper(static_cast<AVLNode<Key, Value>*>(this->root_), f, parallelDepth(threads) + 2);
+}
+
+/**
+* Folds every entry into one result in parallel: lift(key, value) turns an entry into a T and
+* combine(a, b) joins two results, with identity as its neutral element, in the manner of
+* the AggregateAVLTree policies. Results are always combined in key order (left subtree,
+* node, right subtree), so combine must be associative but need not be commutative, e.g.
+* concatenation works. The subtrees are split over threads like in parallel_for_each().
+*/
+template<class Key, class Value, class Balance>
+template<typename T, typename Lift, typename Combine>
+T AVLTree<Key, Value, Balance>::parallel_reduce(const T& identity, Lift lift, Combine combine, unsigned threads) const
+{
+    return reduceHelper(static_cast<AVLNode<Key, Value>*>(this->root_), identity, lift, combine, parallelDepth(threads) + 2);
+}
+
+/**
+* Calls visit on every node of a subtree in key order. It follows parent links instead of
+* recursing, since in bulk mode a subtree can be a long chain.
+*/
+template<class Key, class Value, class Balance>
+template<typename F>
+void AVLTree<Key, Value, Balance>::visitInOrder(AVLNode<Key, Value>* root, F& visit)
+{
+    if (!root) return;
+    AVLNode<Key, Value>* node = root;
+    while (node->getLeft()) node = node->getLeft();
+    while (true)
+    {
+        visit(node);
+        if (node->getRight())
+        {
+            node = node->getRight();
+            while (node->getLeft()) node = node->getLeft();
+            continue;
+        }
+        // Climb out of every subtree we are done with, but not out of root's
+        while (node != root && node->getParent()->getRight() == node) node = node->getParent();
+        if (node == root) return;
+        node = node->getParent();
+    }
+}
+
+template<class Key, class Value, class Balance>
+template<typename F>
+void AVLTree<Key, Value, Balance>::forEachHelper(AVLNode<Key, Value>* node, F& f, int depth)
+{
+    if (!node) return;
+    if (depth <= 0 || node->getHeight() < kParallelHeight)
+    {
+        auto visit = [&](AVLNode<Key, Value>* n) { f(n->getItem()); };
+        visitInOrder(node, visit);
+        return;
+    }
+    parallelInvoke(true,
+        [&]() { forEachHelper(node->getLeft(), f, depth - 1); },
+        [&]()
+        {
+            f(node->getItem());
+            forEachHelper(node->getRight(), f, depth - 1);
+        });
+}
+
+template<class Key, class Value, class Balance>
+template<typename T, typename Lift, typename Combine>
+T AVLTree<Key, Value, Balance>::reduceHelper(AVLNode<Key, Value>* node, const T& identity, Lift& lift, Combine& combine, int depth)
+{
+    if (!node) return identity;
+    if (depth <= 0 || node->getHeight() < kParallelHeight)
+    {
+        T result = identity;
+        auto visit = [&](AVLNode<Key, Value>* n) { result = combine(result, lift(n->getKey(), n->getValue())); };
+        visitInOrder(node, visit);
+        return result;
+    }
+    T left = identity;
+    T right = identity;
+    parallelInvoke(true,
+        [&]() { left = reduceHelper(node->getLeft(), identity, lift, combine, depth - 1); },
+        [&]() { right = reduceHelper(node->getRight(), identity, lift, combine, depth - 1); });
+    return combine(combine(left, lift(node->getKey(), node->getValue())), right);
+}
+
 #endif
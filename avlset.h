@@ -0,0 +1,300 @@
+#ifndef AVLSET_H
+#define AVLSET_H
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+/**
+* The "value" of every AVLSet node. It is never stored: Node<Key, AVLSetTag> below keeps
+* only the key.
+*/
+struct AVLSetTag { };
+
+/**
+* A node that stores no value. It has the same interface as Node, minus getItem(), so all
+* of the BST and AVL code runs on it unchanged. The key is placed after the links so that
+* with small keys AVLNode's height fits into the padding after it.
+*/
+template <typename Key>
+class Node<Key, AVLSetTag>
+{
+public:
+    Node(const Key& key, const AVLSetTag&, Node<Key, AVLSetTag>* parent) :
+        parent_(parent), left_(NULL), right_(NULL), key_(key) {}
+    virtual ~Node() {}
+
+    const Key& getKey() const { return key_; }
+    const AVLSetTag& getValue() const { return tag(); }
+    AVLSetTag& getValue() { return tag(); }
+
+    virtual Node<Key, AVLSetTag>* getParent() const { return parent_; }
+    virtual Node<Key, AVLSetTag>* getLeft() const { return left_; }
+    virtual Node<Key, AVLSetTag>* getRight() const { return right_; }
+
+    void setParent(Node<Key, AVLSetTag>* parent) { parent_ = parent; }
+    void setLeft(Node<Key, AVLSetTag>* left) { left_ = left; }
+    void setRight(Node<Key, AVLSetTag>* right) { right_ = right; }
+    void setValue(const AVLSetTag&) {}
+
+protected:
+    static AVLSetTag& tag() { static AVLSetTag instance; return instance; }
+
+    Node<Key, AVLSetTag>* parent_;
+    Node<Key, AVLSetTag>* left_;
+    Node<Key, AVLSetTag>* right_;
+    const Key key_;
+};
+
+/**
+* An ordered set of keys, balanced by the AVLTree code. Nodes hold no value at all, which
+* saves the padded dummy value of an AVLTree<Key, bool> in every node.
+* The set algebra functions merge the two sorted sequences in O(n + m) and build the
+* result as a perfectly balanced tree.
+*/
+template <class Key>
+class AVLSet : protected AVLTree<Key, AVLSetTag>
+{
+public:
+    typedef AVLTree<Key, AVLSetTag> Base;
+
+    AVLSet();
+    AVLSet(const AVLSet<Key>& other);
+    AVLSet(AVLSet<Key>&& other);
+    AVLSet<Key>& operator=(const AVLSet<Key>& other);
+    AVLSet<Key>& operator=(AVLSet<Key>&& other);
+
+    void insert(const Key& key);
+    using Base::remove;
+    bool contains(const Key& key) const;
+    using Base::clear;
+    using Base::empty;
+    using Base::size;
+    using Base::isBalanced;
+    using Base::defragment;
+
+    /**
+    * An iterator over the keys in order. Keys cannot be changed through it.
+    */
+    class iterator
+    {
+    public:
+        // So the standard algorithms, such as std::set_union(), accept it
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Key value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Key* pointer;
+        typedef const Key& reference;
+
+        iterator();
+
+        const Key& operator*() const;
+        const Key* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class AVLSet<Key>;
+        explicit iterator(const typename Base::iterator& it);
+        typename Base::iterator it_;
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+
+    // Set algebra, each returning a new set
+    AVLSet<Key> set_union(const AVLSet<Key>& other) const;
+    AVLSet<Key> set_intersection(const AVLSet<Key>& other) const;
+    AVLSet<Key> set_difference(const AVLSet<Key>& other) const;
+
+protected:
+    // Replaces the contents with sorted, duplicate-free keys
+    void assignSorted(const std::vector<Key>& keys);
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the AVLSet::iterator.
+  -----------------------------------------------
+*/
+
+template<class Key>
+AVLSet<Key>::iterator::iterator()
+{
+}
+
+template<class Key>
+AVLSet<Key>::iterator::iterator(const typename Base::iterator& it) : it_(it)
+{
+}
+
+template<class Key>
+const Key& AVLSet<Key>::iterator::operator*() const
+{
+    return AVLSet<Key>::nodeOf(it_)->getKey();
+}
+
+template<class Key>
+const Key* AVLSet<Key>::iterator::operator->() const
+{
+    return &**this;
+}
+
+template<class Key>
+bool AVLSet<Key>::iterator::operator==(const iterator& rhs) const
+{
+    return it_ == rhs.it_;
+}
+
+template<class Key>
+bool AVLSet<Key>::iterator::operator!=(const iterator& rhs) const
+{
+    return it_ != rhs.it_;
+}
+
+template<class Key>
+typename AVLSet<Key>::iterator& AVLSet<Key>::iterator::operator++()
+{
+    ++it_;
+    return *this;
+}
+
+/*
+  ---------------------------------------------
+  End implementations for the AVLSet::iterator.
+  ---------------------------------------------
+*/
+
+template<class Key>
+AVLSet<Key>::AVLSet()
+{
+}
+
+/**
+* Copies other's keys, building the copy as a perfectly balanced tree in O(n).
+*/
+template<class Key>
+AVLSet<Key>::AVLSet(const AVLSet<Key>& other)
+{
+    assignSorted(std::vector<Key>(other.begin(), other.end()));
+}
+
+/**
+* Takes over other's nodes, so the set algebra functions can return their result by value.
+*/
+template<class Key>
+AVLSet<Key>::AVLSet(AVLSet<Key>&& other)
+{
+    this->root_ = other.root_;
+    this->resetCache(other.size_);
+    other.root_ = NULL;
+    other.resetCache(0);
+}
+
+template<class Key>
+AVLSet<Key>& AVLSet<Key>::operator=(const AVLSet<Key>& other)
+{
+    if (this != &other) assignSorted(std::vector<Key>(other.begin(), other.end()));
+    return *this;
+}
+
+// Frees the current keys and takes over other's nodes, leaving other empty
+template<class Key>
+AVLSet<Key>& AVLSet<Key>::operator=(AVLSet<Key>&& other)
+{
+    if (this == &other) return *this;
+    this->clear();
+    this->root_ = other.root_;
+    this->resetCache(other.size_);
+    other.root_ = NULL;
+    other.resetCache(0);
+    return *this;
+}
+
+template<class Key>
+void AVLSet<Key>::insert(const Key& key)
+{
+    Base::insert(std::pair<const Key, AVLSetTag>(key, AVLSetTag()));
+}
+
+template<class Key>
+bool AVLSet<Key>::contains(const Key& key) const
+{
+    return this->internalFind(key) != NULL;
+}
+
+template<class Key>
+typename AVLSet<Key>::iterator AVLSet<Key>::begin() const
+{
+    return iterator(Base::begin());
+}
+
+template<class Key>
+typename AVLSet<Key>::iterator AVLSet<Key>::end() const
+{
+    return iterator(Base::end());
+}
+
+template<class Key>
+typename AVLSet<Key>::iterator AVLSet<Key>::find(const Key& key) const
+{
+    return iterator(Base::find(key));
+}
+
+template<class Key>
+typename AVLSet<Key>::iterator AVLSet<Key>::lower_bound(const Key& key) const
+{
+    return iterator(Base::lower_bound(key));
+}
+
+template<class Key>
+void AVLSet<Key>::assignSorted(const std::vector<Key>& keys)
+{
+    this->clear();
+    if (keys.empty()) return;
+    std::vector<std::pair<Key, AVLSetTag> > items;
+    items.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) items.push_back(std::make_pair(keys[i], AVLSetTag()));
+    this->root_ = this->buildBalanced(&items[0], items.size(), 0);
+    this->resetCache(items.size());
+}
+
+template<class Key>
+AVLSet<Key> AVLSet<Key>::set_union(const AVLSet<Key>& other) const
+{
+    std::vector<Key> keys;
+    std::set_union(begin(), end(), other.begin(), other.end(), std::back_inserter(keys));
+    AVLSet<Key> result;
+    result.assignSorted(keys);
+    return result;
+}
+
+template<class Key>
+AVLSet<Key> AVLSet<Key>::set_intersection(const AVLSet<Key>& other) const
+{
+    std::vector<Key> keys;
+    std::set_intersection(begin(), end(), other.begin(), other.end(), std::back_inserter(keys));
+    AVLSet<Key> result;
+    result.assignSorted(keys);
+    return result;
+}
+
+template<class Key>
+AVLSet<Key> AVLSet<Key>::set_difference(const AVLSet<Key>& other) const
+{
+    std::vector<Key> keys;
+    std::set_difference(begin(), end(), other.begin(), other.end(), std::back_inserter(keys));
+    AVLSet<Key> result;
+    result.assignSorted(keys);
+    return result;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "flat_combining_avlbst.h"
+
+/**
+* Throughput of FlatCombiningAVLTree against an AVLTree behind one std::mutex, for 8 to 64
+* threads hammering the same tree with a mix of half finds, a quarter inserts and a quarter
+* removes over a fixed key range. Usage: flat_combining_bench [operations per thread]
+*/
+
+static const int kKeys = 1 << 16;
+
+// The baseline: every operation takes the lock itself
+class LockedAVLTree
+{
+public:
+    void insert(const std::pair<const int, int>& keyValuePair)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        tree_.insert(keyValuePair);
+    }
+    void remove(const int& key)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        tree_.remove(key);
+    }
+    bool find(const int& key, int& value)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        AVLTree<int, int>::iterator it = tree_.find(key);
+        if (it == tree_.end()) return false;
+        value = it->second;
+        return true;
+    }
+
+private:
+    std::mutex lock_;
+    AVLTree<int, int> tree_;
+};
+
+// Runs operations per thread on threads threads and returns millions of operations per second
+template <class Tree>
+static double run(Tree& tree, int threads, int operations)
+{
+    for (int key = 0; key < kKeys; key += 2) tree.insert(std::make_pair(key, key));
+    std::vector<std::thread> workers;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++)
+    {
+        workers.push_back(std::thread([&tree, t, operations]()
+        {
+            unsigned state = 2654435761u * (t + 1);
+            int value = 0;
+            for (int i = 0; i < operations; i++)
+            {
+                state = state * 1103515245u + 12345u;
+                int key = (state >> 8) % kKeys;
+                switch (state >> 30)
+                {
+                    case 0: tree.insert(std::make_pair(key, i)); break;
+                    case 1: tree.remove(key); break;
+                    default: tree.find(key, value); break;
+                }
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return threads * static_cast<double>(operations) / seconds / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    int operations = argc > 1 ? std::atoi(argv[1]) : 100000;
+    std::printf("%8s %16s %16s\n", "threads", "combining Mop/s", "mutex Mop/s");
+    for (int threads = 8; threads <= 64; threads *= 2)
+    {
+        FlatCombiningAVLTree<int, int> combining(threads + 1); // The main thread fills it first
+        LockedAVLTree locked;
+        double combined = run(combining, threads, operations);
+        double mutex = run(locked, threads, operations);
+        std::printf("%8d %16.2f %16.2f\n", threads, combined, mutex);
+    }
+    return 0;
+}
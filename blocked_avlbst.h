@@ -0,0 +1,353 @@
+#ifndef BLOCKED_AVLBST_H
+#define BLOCKED_AVLBST_H
+
+#include <cstddef>
+#include <utility>
+#include "avlbst.h"
+
+/**
+* A small sorted array of entries, stored as the value of one BlockedAVLTree node. Keys are
+* kept apart from values so a search within the block only touches the keys.
+*/
+template <typename Key, typename Value, int Capacity>
+struct AVLBlock
+{
+    AVLBlock() : size(0) {}
+
+    // Index of the first key not less than key, by linear scan (the block is a cache line or two)
+    int lowerBound(const Key& key) const
+    {
+        int i = 0;
+        while (i < size && keys[i] < key) i++;
+        return i;
+    }
+
+    int size;
+    Key keys[Capacity];
+    Value values[Capacity];
+};
+
+/**
+* An AVL tree whose nodes each hold up to BlockSize sorted entries instead of one, which cuts
+* the height of the tree, and so the number of cache lines touched by a lookup, by about
+* log2(BlockSize). Blocks cover disjoint, increasing key ranges. A full block is split in
+* two and a block that falls below a quarter full is merged with its successor when they
+* fit together, so the tree holds at most about 4n / BlockSize blocks.
+*
+* The blocks are balanced by AVLTree itself: new blocks are linked next to the block they
+* were split from and retraced with rebalanceAfterInsert(), empty ones are taken out with
+* unlinkNode(). Neither looks at keys, so the node key is only a label (the first key the
+* block held) and ordering comes from the block contents.
+* Key and Value must be default constructible.
+*/
+template <class Key, class Value, int BlockSize = 16>
+class BlockedAVLTree : protected AVLTree<Key, AVLBlock<Key, Value, BlockSize> >
+{
+public:
+    typedef AVLBlock<Key, Value, BlockSize> Block;
+    typedef AVLNode<Key, Block> BlockNode;
+
+    BlockedAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    size_t size() const;
+    bool empty() const;
+    using AVLTree<Key, Block>::clear;
+    using AVLTree<Key, Block>::isBalanced;
+
+    /**
+    * An iterator over every entry in key order. Dereferencing yields a pair of references
+    * into the block, since keys and values are not stored as pairs.
+    */
+    class iterator
+    {
+    public:
+        iterator();
+
+        std::pair<const Key&, Value&> operator*() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class BlockedAVLTree<Key, Value, BlockSize>;
+        iterator(BlockNode* node, int index);
+        BlockNode* node_;
+        int index_;
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+
+protected:
+    BlockNode* findBlock(const Key& key) const;
+    static BlockNode* successor(BlockNode* node);
+    BlockNode* linkAfter(BlockNode* node, const Block& block);
+    void unlinkBlock(BlockNode* node);
+    virtual void treeCleared() override;
+
+    size_t count_;
+};
+
+/*
+  -----------------------------------------------------
+  Begin implementations for the BlockedAVLTree::iterator.
+  -----------------------------------------------------
+*/
+
+template<class Key, class Value, int BlockSize>
+BlockedAVLTree<Key, Value, BlockSize>::iterator::iterator() : node_(NULL), index_(0)
+{
+}
+
+template<class Key, class Value, int BlockSize>
+BlockedAVLTree<Key, Value, BlockSize>::iterator::iterator(BlockNode* node, int index) : node_(node), index_(index)
+{
+}
+
+template<class Key, class Value, int BlockSize>
+std::pair<const Key&, Value&> BlockedAVLTree<Key, Value, BlockSize>::iterator::operator*() const
+{
+    Block& block = node_->getValue();
+    return std::pair<const Key&, Value&>(block.keys[index_], block.values[index_]);
+}
+
+template<class Key, class Value, int BlockSize>
+bool BlockedAVLTree<Key, Value, BlockSize>::iterator::operator==(const iterator& rhs) const
+{
+    return node_ == rhs.node_ && index_ == rhs.index_;
+}
+
+template<class Key, class Value, int BlockSize>
+bool BlockedAVLTree<Key, Value, BlockSize>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<class Key, class Value, int BlockSize>
+typename BlockedAVLTree<Key, Value, BlockSize>::iterator& BlockedAVLTree<Key, Value, BlockSize>::iterator::operator++()
+{
+    if (!node_) return *this;
+    if (++index_ < node_->getValue().size) return *this;
+    node_ = successor(node_); // End of this block, move on to the next one
+    index_ = 0;
+    return *this;
+}
+
+/*
+  ---------------------------------------------------
+  End implementations for the BlockedAVLTree::iterator.
+  ---------------------------------------------------
+*/
+
+template<class Key, class Value, int BlockSize>
+BlockedAVLTree<Key, Value, BlockSize>::BlockedAVLTree() : count_(0)
+{
+    static_assert(BlockSize >= 4, "BlockedAVLTree blocks need room for at least 4 entries");
+}
+
+template<class Key, class Value, int BlockSize>
+size_t BlockedAVLTree<Key, Value, BlockSize>::size() const
+{
+    return count_;
+}
+
+template<class Key, class Value, int BlockSize>
+bool BlockedAVLTree<Key, Value, BlockSize>::empty() const
+{
+    return count_ == 0;
+}
+
+// clear() drops every block at once, so the entry count starts over with them
+template<class Key, class Value, int BlockSize>
+void BlockedAVLTree<Key, Value, BlockSize>::treeCleared()
+{
+    AVLTree<Key, Block>::treeCleared();
+    count_ = 0;
+}
+
+// The in-order successor of a block, found the same way as BinarySearchTree::iterator::operator++
+template<class Key, class Value, int BlockSize>
+AVLNode<Key, AVLBlock<Key, Value, BlockSize> >* BlockedAVLTree<Key, Value, BlockSize>::successor(BlockNode* node)
+{
+    if (node->getRight())
+    {
+        node = node->getRight();
+        while (node->getLeft()) node = node->getLeft();
+        return node;
+    }
+    while (node->getParent() && node->getParent()->getRight() == node) node = node->getParent();
+    return node->getParent();
+}
+
+/**
+* Descends by block range: left if key is below the block's first key, right if it is above
+* the last key, otherwise the key can only be in this block. Returns the block where the
+* search stopped, i.e. the block holding key or the one next to where it would go.
+*/
+template<class Key, class Value, int BlockSize>
+AVLNode<Key, AVLBlock<Key, Value, BlockSize> >* BlockedAVLTree<Key, Value, BlockSize>::findBlock(const Key& key) const
+{
+    BlockNode* node = static_cast<BlockNode*>(this->root_);
+    BlockNode* last = node;
+    while (node)
+    {
+        last = node;
+        const Block& block = node->getValue();
+        if (key < block.keys[0]) node = node->getLeft();
+        else if (block.keys[block.size - 1] < key) node = node->getRight();
+        else return node;
+    }
+    return last;
+}
+
+/**
+* Links a new block right after node in key order: as node's right child if it has none,
+* otherwise as the left child of the leftmost node of node's right subtree.
+*/
+template<class Key, class Value, int BlockSize>
+AVLNode<Key, AVLBlock<Key, Value, BlockSize> >* BlockedAVLTree<Key, Value, BlockSize>::linkAfter(BlockNode* node, const Block& block)
+{
+    BlockNode* parent = node;
+    bool asRight = !node->getRight();
+    if (!asRight)
+    {
+        parent = node->getRight();
+        while (parent->getLeft()) parent = parent->getLeft();
+    }
+    BlockNode* newNode = this->createNode(block.keys[0], block, parent);
+    if (asRight) parent->setRight(newNode);
+    else parent->setLeft(newNode);
+    this->nodeLinked(newNode);
+    this->updateNode(newNode);
+    this->rebalanceAfterInsert(parent);
+    return newNode;
+}
+
+template<class Key, class Value, int BlockSize>
+void BlockedAVLTree<Key, Value, BlockSize>::unlinkBlock(BlockNode* node)
+{
+    delete this->unlinkNode(node);
+}
+
+/**
+* Inserts into the block whose range the key falls into (or next to). A full block is first
+* split into two half-full blocks.
+*/
+template<class Key, class Value, int BlockSize>
+void BlockedAVLTree<Key, Value, BlockSize>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    const Key& key = keyValuePair.first;
+    if (!this->root_)
+    {
+        Block block;
+        block.keys[0] = key;
+        block.values[0] = keyValuePair.second;
+        block.size = 1;
+        this->root_ = this->createNode(key, block, NULL);
+        this->nodeLinked(static_cast<BlockNode*>(this->root_));
+        count_++;
+        return;
+    }
+    BlockNode* node = findBlock(key);
+    Block* block = &node->getValue();
+    int index = block->lowerBound(key);
+    if (index < block->size && block->keys[index] == key) // If same key, update value
+    {
+        block->values[index] = keyValuePair.second;
+        return;
+    }
+    if (block->size == BlockSize) // Full, move the upper half into a new block after this one
+    {
+        Block upper;
+        int half = BlockSize / 2;
+        for (int i = half; i < BlockSize; i++)
+        {
+            upper.keys[i - half] = block->keys[i];
+            upper.values[i - half] = block->values[i];
+        }
+        upper.size = BlockSize - half;
+        block->size = half;
+        BlockNode* upperNode = linkAfter(node, upper);
+        if (index > half) // The new key belongs in the upper half
+        {
+            block = &upperNode->getValue();
+            index -= half;
+        }
+    }
+    for (int i = block->size; i > index; i--) // Shift the larger entries up
+    {
+        block->keys[i] = block->keys[i - 1];
+        block->values[i] = block->values[i - 1];
+    }
+    block->keys[index] = key;
+    block->values[index] = keyValuePair.second;
+    block->size++;
+    count_++;
+}
+
+/**
+* Removes key from its block. An empty block is unlinked, and a block below a quarter full
+* absorbs its successor if both fit in one block.
+*/
+template<class Key, class Value, int BlockSize>
+void BlockedAVLTree<Key, Value, BlockSize>::remove(const Key& key)
+{
+    if (!this->root_) return;
+    BlockNode* node = findBlock(key);
+    Block& block = node->getValue();
+    int index = block.lowerBound(key);
+    if (index == block.size || !(block.keys[index] == key)) return; // Not in the tree
+    for (int i = index; i + 1 < block.size; i++)
+    {
+        block.keys[i] = block.keys[i + 1];
+        block.values[i] = block.values[i + 1];
+    }
+    block.size--;
+    count_--;
+    if (block.size == 0)
+    {
+        unlinkBlock(node);
+        return;
+    }
+    if (block.size >= BlockSize / 4) return;
+    BlockNode* next = successor(node);
+    if (!next || block.size + next->getValue().size > BlockSize) return;
+    Block& nextBlock = next->getValue();
+    for (int i = 0; i < nextBlock.size; i++)
+    {
+        block.keys[block.size + i] = nextBlock.keys[i];
+        block.values[block.size + i] = nextBlock.values[i];
+    }
+    block.size += nextBlock.size;
+    unlinkBlock(next);
+}
+
+template<class Key, class Value, int BlockSize>
+typename BlockedAVLTree<Key, Value, BlockSize>::iterator BlockedAVLTree<Key, Value, BlockSize>::begin() const
+{
+    return iterator(this->min_, 0);
+}
+
+template<class Key, class Value, int BlockSize>
+typename BlockedAVLTree<Key, Value, BlockSize>::iterator BlockedAVLTree<Key, Value, BlockSize>::end() const
+{
+    return iterator();
+}
+
+template<class Key, class Value, int BlockSize>
+typename BlockedAVLTree<Key, Value, BlockSize>::iterator BlockedAVLTree<Key, Value, BlockSize>::find(const Key& key) const
+{
+    if (!this->root_) return end();
+    BlockNode* node = findBlock(key);
+    const Block& block = node->getValue();
+    int index = block.lowerBound(key);
+    if (index == block.size || !(block.keys[index] == key)) return end();
+    return iterator(node, index);
+}
+
+#endif
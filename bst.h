@@ -2,9 +2,24 @@
 #define BST_H
 
 #include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <exception>
 #include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <utility>
+#include <vector>
+#include "parallel.h"
+
+// Hint the CPU to start loading a node before we need it
+#if defined(__GNUC__) || defined(__clang__)
+#define BST_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define BST_PREFETCH(address) ((void)0)
+#endif
 
 /**
  * A templated class for a Node in a search tree.
@@ -18,6 +33,7 @@ class Node
 {
 public:
     Node(const Key& key, const Value& value, Node<Key, Value>* parent);
+    Node(Node<Key, Value>&& other);
     virtual ~Node();
 
     const std::pair<const Key, Value>& getItem() const;
@@ -61,6 +77,20 @@ Node<Key, Value>::Node(const Key& key, const Value& value, Node<Key, Value>* par
 
 }
 
+/**
+* A move constructor, for nodes that are moved to new memory: takes over other's item,
+* leaving its value moved from, and its links. The nodes linked to other still point at it.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>::Node(Node<Key, Value>&& other) :
+    item_(std::move(other.item_)),
+    parent_(other.parent_),
+    left_(other.left_),
+    right_(other.right_)
+{
+
+}
+
 /**
 * Destructor, which does not need to do anything since the pointers inside of a node
 * are only used as references to existing nodes. The nodes pointed to by parent/left/right
@@ -186,6 +216,79 @@ void Node<Key, Value>::setValue(const Value& value)
   ---------------------------------------
 */
 
+/**
+* The background thread behind BinarySearchTree::clear_deferred(). Detached trees are queued
+* and freed one after another by a single thread, started by the first clear_deferred().
+* The thread is joinable rather than detached: wait() blocks until the queue is empty, and
+* the destructor, which runs when static objects are destroyed at exit, drains the queue and
+* joins the thread, so no teardown is still running once the program is gone.
+*/
+class DeferredTeardown
+{
+public:
+    static DeferredTeardown& instance()
+    {
+        static DeferredTeardown teardown;
+        return teardown;
+    }
+
+    // Queues work for the thread, starting it if needed. Throws if it cannot be started
+    void post(std::function<void()> work)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!thread_.joinable()) thread_ = std::thread(&DeferredTeardown::run, this);
+        queue_.push_back(std::move(work));
+        changed_.notify_all();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        changed_.wait(guard, [this]() { return queue_.empty() && !busy_; });
+    }
+
+    ~DeferredTeardown()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stopping_ = true;
+            changed_.notify_all();
+        }
+        if (thread_.joinable()) thread_.join();
+    }
+
+protected:
+    DeferredTeardown() : busy_(false), stopping_(false) {}
+    DeferredTeardown(const DeferredTeardown&);
+    DeferredTeardown& operator=(const DeferredTeardown&);
+
+    // Frees queued trees until asked to stop with nothing left in the queue
+    void run()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        for (;;)
+        {
+            changed_.wait(guard, [this]() { return !queue_.empty() || stopping_; });
+            if (queue_.empty()) return;
+            std::function<void()> work = std::move(queue_.front());
+            queue_.pop_front();
+            busy_ = true;
+            guard.unlock();
+            work();
+            guard.lock();
+            busy_ = false;
+            changed_.notify_all();
+        }
+    }
+
+    std::mutex lock_;
+    std::condition_variable changed_;
+    std::deque<std::function<void()> > queue_;
+    bool busy_; // A tree taken off the queue is being freed
+    bool stopping_;
+    std::thread thread_;
+};
+
 /**
 * A templated unbalanced binary search tree.
 */
@@ -198,6 +301,14 @@ public:
     virtual void insert(const std::pair<const Key, Value>& keyValuePair);
     virtual void remove(const Key& key);
     void clear();
+    // Teardown for large trees, see the comments above their implementations
+    void clear_parallel(unsigned threads = 0);
+    // The nodes are freed later on a shared background thread, which is joined at static
+    // destruction: key and value destructors must not use static objects constructed after
+    // the first clear_deferred() call, since those are destroyed first. wait_deferred()
+    // returns once every teardown started so far has finished
+    void clear_deferred();
+    static void wait_deferred();
     bool isBalanced() const;
     void print() const;
     bool empty() const;
@@ -228,6 +339,9 @@ public:
     iterator begin() const;
     iterator end() const;
     iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+    void find_many(const Key* keys, size_t count, iterator* out) const;
+    void find_many(const std::vector<Key>& keys, std::vector<iterator>& out) const;
 
 protected:
     // Mandatory helper functions
@@ -238,18 +352,32 @@ protected:
     //        and instead just use the input argument.
 
     // Provided helper functions
-    virtual void printRoot (Node<Key, Value> *r) const;
+    // Not virtual, so it is only instantiated (and Value only needs operator<<) when print() is used
+    void printRoot (Node<Key, Value> *r) const;
     virtual void nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2) ;
 
     // Add helper functions here
+    static iterator makeIterator(Node<Key, Value>* node);
+    static Node<Key, Value>* nodeOf(const iterator& it);
     int getHeight(Node<Key, Value>* node) const;
     Node<Key, Value>* internalFindHelper(const Key& k, Node<Key, Value>* node) const;
     bool isBalancedHelper(Node<Key, Value>* node) const;
-    void clearHelper(Node<Key, Value>* node);
+    static void clearHelper(Node<Key, Value>* node, int depth = 0);
+    static void clearRotating(Node<Key, Value>* node);
+    static void clearParallelHelper(Node<Key, Value>* node, int depth);
+    // Called after clear() or one of its variants has emptied the tree
+    virtual void treeCleared();
 
 protected:
     Node<Key, Value>* root_;
     // You should not need other data members
+
+    // How many searches find_many() advances in lockstep
+    static const size_t kFindGroup = 16;
+    // clearHelper() recurses at most this deep before switching to clearRotating()
+    static const int kClearDepth = 64;
+    // clear_parallel() frees a subtree on the current thread if its leftmost path is shorter than this
+    static const int kParallelSpine = 10;
 };
 
 /*
@@ -356,6 +484,29 @@ Begin implementations for the BinarySearchTree class.
 -----------------------------------------------------
 */
 
+// Definition for the in-class constant, which std::min() binds to a reference
+template<class Key, class Value>
+const size_t BinarySearchTree<Key, Value>::kFindGroup;
+
+/**
+* Wraps a node in an iterator, for subclasses that find nodes on their own
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::makeIterator(Node<Key, Value>* node)
+{
+    return iterator(node);
+}
+
+/**
+* The node an iterator points to, the inverse of makeIterator()
+*/
+template<class Key, class Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::nodeOf(const iterator& it)
+{
+    return it.current_;
+}
+
 template<class Key, class Value>
 int BinarySearchTree<Key, Value>::getHeight(Node<Key, Value>* node) const
 {
@@ -430,6 +581,82 @@ BinarySearchTree<Key, Value>::find(const Key & k) const
     return it;
 }
 
+/**
+* Returns an iterator to the first item whose key is not less than k,
+* or the end iterator if there is none
+*/
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::iterator
+BinarySearchTree<Key, Value>::lower_bound(const Key& k) const
+{
+    Node<Key, Value>* node = root_;
+    Node<Key, Value>* best = NULL;
+    while (node)
+    {
+        if (node->getKey() < k) node = node->getRight(); // node and its left subtree are too small
+        else
+        {
+            best = node; // Candidate, but there may be a smaller one on the left
+            node = node->getLeft();
+        }
+    }
+    return iterator(best);
+}
+
+/**
+* Looks up count keys and stores an iterator for each in out (end() if the key is missing).
+* Instead of finishing one search before starting the next, groups of kFindGroup searches
+* advance one level at a time in lockstep, and the next node of each is prefetched while
+* the rest of the group is compared. This overlaps the cache misses of independent
+* searches, which is where a lookup in a large tree spends most of its time.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::find_many(const Key* keys, size_t count, iterator* out) const
+{
+    Node<Key, Value>* cursors[kFindGroup];
+    for (size_t base = 0; base < count; base += kFindGroup)
+    {
+        size_t groupSize = std::min(kFindGroup, count - base);
+        for (size_t i = 0; i < groupSize; i++) cursors[i] = root_;
+        size_t active = root_ ? groupSize : 0;
+        if (!root_) for (size_t i = 0; i < groupSize; i++) out[base + i] = end();
+        while (active) // One pass moves every unfinished search down one level
+        {
+            active = 0;
+            for (size_t i = 0; i < groupSize; i++)
+            {
+                Node<Key, Value>* node = cursors[i];
+                if (!node) continue; // This search is already done
+                const Key& key = keys[base + i];
+                if (node->getKey() == key)
+                {
+                    out[base + i] = iterator(node);
+                    cursors[i] = NULL;
+                    continue;
+                }
+                node = key < node->getKey() ? node->getLeft() : node->getRight();
+                cursors[i] = node;
+                if (node)
+                {
+                    BST_PREFETCH(node);
+                    active++;
+                }
+                else out[base + i] = end(); // Fell off the tree, key is missing
+            }
+        }
+    }
+}
+
+/**
+* Convenience overload of find_many() for vectors, out is resized to match keys.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::find_many(const std::vector<Key>& keys, std::vector<iterator>& out) const
+{
+    out.resize(keys.size());
+    if (!keys.empty()) find_many(&keys[0], keys.size(), &out[0]);
+}
+
 /**
 * An insert method to insert into a Binary Search Tree.
 * The tree will not remain balanced when inserting.
@@ -564,15 +791,78 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
     return predecessor;
 }
 
+/**
+* Frees a subtree, recursing into left children and looping down right children, so only
+* the left links of a path cost stack. That is as fast as plain recursion, and a subtree
+* more than kClearDepth left links deep (only an unbalanced tree gets that deep) is handed
+* to clearRotating(), which needs no stack at all.
+*/
 template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clearHelper(Node<Key, Value>* node)
+void BinarySearchTree<Key, Value>::clearHelper(Node<Key, Value>* node, int depth)
 {
-    if (node)
+    if (depth >= kClearDepth)
     {
-        clearHelper(node->getLeft());
-        clearHelper(node->getRight());
+        clearRotating(node);
+        return;
     }
+    while (node)
+    {
+        clearHelper(node->getLeft(), depth + 1);
+        Node<Key, Value>* right = node->getRight();
+        delete node;
+        node = right;
+    }
+}
+
+/**
+* Frees a subtree without recursion or extra memory: while the current node has a left
+* child, that child is rotated up, which turns the subtree into a chain of right children
+* that is freed from the top. Each node is rotated at most once, so this is O(n) for any
+* shape of tree.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::clearRotating(Node<Key, Value>* node)
+{
+    while (node)
+    {
+        Node<Key, Value>* left = node->getLeft();
+        if (left)
+        {
+            node->setLeft(left->getRight());
+            left->setRight(node);
+            node = left;
+        }
+        else
+        {
+            Node<Key, Value>* right = node->getRight();
+            delete node;
+            node = right;
+        }
+    }
+}
+
+// Helper function for clear_parallel(): frees the two subtrees of each of the top depth levels on two threads
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::clearParallelHelper(Node<Key, Value>* node, int depth)
+{
+    int spine = 0;
+    for (Node<Key, Value>* n = node; n && spine < kParallelSpine; n = n->getLeft()) spine++;
+    if (depth <= 0 || spine < kParallelSpine)
+    {
+        clearHelper(node);
+        return;
+    }
+    Node<Key, Value>* left = node->getLeft();
+    Node<Key, Value>* right = node->getRight();
     delete node;
+    parallelInvoke(true,
+        [&]() { clearParallelHelper(left, depth - 1); },
+        [&]() { clearParallelHelper(right, depth - 1); });
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::treeCleared()
+{
 }
 
 /**
@@ -584,6 +874,49 @@ void BinarySearchTree<Key, Value>::clear()
 {
     clearHelper(root_);
     root_ = NULL; // Need to reset root to NULL to prevent users from accessing the tree again using the root pointer after it is deleted
+    treeCleared();
+}
+
+/**
+* Like clear(), but the subtrees below the top levels are freed on up to threads threads
+* (0 means one per hardware thread). Small subtrees are freed on the calling thread.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::clear_parallel(unsigned threads)
+{
+    Node<Key, Value>* root = root_;
+    root_ = NULL;
+    clearParallelHelper(root, parallelDepth(threads));
+    treeCleared();
+}
+
+/**
+* Empties the tree at once and hands the detached nodes to the DeferredTeardown thread, so
+* the caller does not wait for a large teardown. The keys' and values' destructors then run
+* on that thread and must not depend on anything the caller may destroy in the meantime. If
+* the thread cannot be started, the nodes are freed here instead.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::clear_deferred()
+{
+    Node<Key, Value>* root = root_;
+    root_ = NULL;
+    treeCleared();
+    if (!root) return;
+    try
+    {
+        DeferredTeardown::instance().post([root]() { clearHelper(root); });
+    }
+    catch (const std::exception&)
+    {
+        clearHelper(root);
+    }
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::wait_deferred()
+{
+    DeferredTeardown::instance().wait();
 }
 
 /**
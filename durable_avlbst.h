@@ -0,0 +1,449 @@
+#ifndef DURABLE_AVLBST_H
+#define DURABLE_AVLBST_H
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "avlbst.h"
+
+/**
+* The header at the start of a DurableAVLTree snapshot file, followed by count entries in
+* key order.
+*/
+struct DurableAVLSnapshotHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t entrySize; // sizeof the entry type, to reject files written with other Key/Value types
+    uint64_t count;
+    uint64_t checksum; // Of the entries
+};
+
+/**
+* An AVLTree made crash durable by an append-only operation log next to a binary snapshot,
+* both on a local filesystem: path + ".snap" and path + ".log". Every insert() and remove()
+* appends a checksummed record to the log and returns once the record is on disk. Writers
+* that arrive while a sync is running queue their records behind it, and the next sync
+* (done by whichever of them gets there first) writes and fsyncs all of them at once, so
+* with many writers the number of fsyncs grows with time spent, not with operations.
+*
+* Opening loads the snapshot and replays the log on top of it. A crash can leave a torn
+* record at the end of the log; replay stops at the first record whose checksum does not
+* match and cuts the log there. compact() writes the current contents to a new snapshot and
+* empties the log. Replaying a log on top of a snapshot that already contains its effects
+* changes nothing, so a crash in the middle of compact() is harmless.
+*
+* All public functions are thread-safe. A change reaches the in-memory tree, and so find(),
+* only once its record is durable; each sync applies its batch in log order. If a write or
+* fsync fails, the batch is dropped, its writers get an exception, and the tree stops
+* accepting changes, so memory never holds a change the log may have lost.
+* Key and Value are stored byte-for-byte, so they must be trivially copyable.
+*/
+template <typename Key, typename Value>
+class DurableAVLTree
+{
+    static_assert(std::is_trivially_copyable<Key>::value, "DurableAVLTree keys must be trivially copyable");
+    static_assert(std::is_trivially_copyable<Value>::value, "DurableAVLTree values must be trivially copyable");
+
+public:
+    explicit DurableAVLTree(const std::string& path);
+    ~DurableAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    // Copies the value of key into value and returns true, or returns false if key is missing
+    bool find(const Key& key, Value& value) const;
+    size_t size() const;
+    // Replaces the snapshot with the current contents and empties the log
+    void compact();
+
+protected:
+    enum Operation { kInsert = 1, kRemove = 2 };
+
+    // One log record. Records are zeroed before being filled in, so padding is checksummed as zeros
+    struct LogRecord
+    {
+        uint64_t checksum; // Of the bytes after it
+        uint32_t operation;
+        Key key;
+        Value value;
+    };
+
+    struct SnapshotEntry
+    {
+        Key key;
+        Value value;
+    };
+
+    DurableAVLTree(const DurableAVLTree&);
+    DurableAVLTree& operator=(const DurableAVLTree&);
+
+    void loadSnapshot();
+    void replayLog();
+    void apply(const LogRecord& record);
+    // Appends a record, waits until it is durable and applied to tree_. Called with lock_ held
+    void commit(Operation operation, const Key& key, const Value& value, std::unique_lock<std::mutex>& lock);
+
+    static uint64_t checksum(const void* data, size_t size);
+    static uint64_t checksumRecord(const LogRecord& record);
+    static void writeAll(int fd, const void* data, size_t size, const std::string& what);
+    static void syncFile(int fd, const std::string& what);
+    static void syncDirectory(const std::string& path);
+
+    static const uint64_t kMagic = 0x50414e5344564c41ULL; // "ALVDSNAP", little-endian
+    static const uint32_t kVersion = 1;
+
+    mutable std::mutex lock_; // Guards everything below
+    std::condition_variable synced_; // Signalled when a sync finishes
+    AVLTree<Key, Value> tree_;
+    const std::string path_;
+    int logFd_;
+    std::vector<LogRecord> pending_; // Records not yet handed to a sync
+    uint64_t appended_; // Records ever appended
+    uint64_t durable_; // Records known to be on disk
+    bool syncing_; // Whether a writer or compact() owns the log, with lock_ released
+    bool failed_; // Set when a write or fsync failed; the log may then be missing records
+};
+
+template<class Key, class Value>
+DurableAVLTree<Key, Value>::DurableAVLTree(const std::string& path) :
+    path_(path), logFd_(-1), appended_(0), durable_(0), syncing_(false), failed_(false)
+{
+    loadSnapshot();
+    logFd_ = ::open((path_ + ".log").c_str(), O_RDWR | O_CREAT, 0644);
+    if (logFd_ < 0) throw std::runtime_error("DurableAVLTree: cannot open " + path_ + ".log: " + std::strerror(errno));
+    try
+    {
+        replayLog();
+    }
+    catch (...)
+    {
+        ::close(logFd_);
+        throw;
+    }
+}
+
+// Every change already waited for its sync, so there is nothing left to flush
+template<class Key, class Value>
+DurableAVLTree<Key, Value>::~DurableAVLTree()
+{
+    ::close(logFd_);
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::loadSnapshot()
+{
+    std::string file = path_ + ".snap";
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno == ENOENT) return; // A new tree
+        throw std::runtime_error("DurableAVLTree: cannot open " + file + ": " + std::strerror(errno));
+    }
+    DurableAVLSnapshotHeader header;
+    std::vector<SnapshotEntry> entries;
+    ssize_t got = ::read(fd, &header, sizeof(header));
+    bool valid = got == static_cast<ssize_t>(sizeof(header)) && header.magic == kMagic && header.version == kVersion;
+    if (valid && header.entrySize != sizeof(SnapshotEntry))
+    {
+        ::close(fd);
+        throw std::runtime_error("DurableAVLTree: " + file + " was written with different key/value types");
+    }
+    if (valid)
+    {
+        entries.resize(header.count);
+        size_t bytes = entries.size() * sizeof(SnapshotEntry);
+        size_t done = 0;
+        while (done < bytes)
+        {
+            ssize_t n = ::read(fd, reinterpret_cast<char*>(entries.data()) + done, bytes - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        valid = done == bytes && checksum(entries.data(), bytes) == header.checksum;
+    }
+    ::close(fd);
+    // Snapshots are renamed into place only once complete, so a bad one is corruption, not a crash
+    if (!valid) throw std::runtime_error("DurableAVLTree: " + file + " is not a valid snapshot");
+    std::vector<std::pair<Key, Value> > items;
+    items.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) items.push_back(std::make_pair(entries[i].key, entries[i].value));
+    tree_.assign(items.begin(), items.end());
+}
+
+/**
+* Applies every intact record of the log in order, then cuts off whatever follows the last
+* one: the remains of a write that a crash interrupted, which was never acknowledged.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::replayLog()
+{
+    std::vector<LogRecord> records(4096);
+    off_t good = 0;
+    bool torn = false;
+    while (!torn)
+    {
+        size_t bytes = 0;
+        while (bytes < records.size() * sizeof(LogRecord))
+        {
+            ssize_t n = ::read(logFd_, reinterpret_cast<char*>(records.data()) + bytes, records.size() * sizeof(LogRecord) - bytes);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throw std::runtime_error(std::string("DurableAVLTree: cannot read log: ") + std::strerror(errno));
+            if (n == 0) break;
+            bytes += n;
+        }
+        size_t count = bytes / sizeof(LogRecord);
+        if (count * sizeof(LogRecord) != bytes) torn = true;
+        for (size_t i = 0; i < count; i++)
+        {
+            const LogRecord& record = records[i];
+            if (record.checksum != checksumRecord(record) || (record.operation != kInsert && record.operation != kRemove))
+            {
+                torn = true;
+                break;
+            }
+            apply(record);
+            good += sizeof(LogRecord);
+        }
+        if (bytes < records.size() * sizeof(LogRecord)) break; // End of the log
+    }
+    if (::ftruncate(logFd_, good) != 0) throw std::runtime_error(std::string("DurableAVLTree: cannot truncate log: ") + std::strerror(errno));
+    if (::lseek(logFd_, good, SEEK_SET) < 0) throw std::runtime_error(std::string("DurableAVLTree: cannot seek log: ") + std::strerror(errno));
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::apply(const LogRecord& record)
+{
+    if (record.operation == kInsert) tree_.insert(std::make_pair(record.key, record.value));
+    else tree_.remove(record.key);
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    std::unique_lock<std::mutex> lock(lock_);
+    if (failed_) throw std::runtime_error("DurableAVLTree: an earlier log write failed");
+    commit(kInsert, keyValuePair.first, keyValuePair.second, lock);
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::remove(const Key& key)
+{
+    std::unique_lock<std::mutex> lock(lock_);
+    if (failed_) throw std::runtime_error("DurableAVLTree: an earlier log write failed");
+    commit(kRemove, key, Value(), lock);
+}
+
+/**
+* Group commit. The record joins pending_; then, until it is durable, either the log is busy
+* (wait, our record may be in the batch being synced) or it is not, and this writer takes
+* everything pending, writes and fsyncs it with lock_ released, applies the batch to tree_
+* and wakes the others. While it syncs, new records pile up in pending_ for the next sync.
+* Only the syncing writer touches tree_, so batches reach it in the order they reach the log.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::commit(Operation operation, const Key& key, const Value& value, std::unique_lock<std::mutex>& lock)
+{
+    LogRecord record;
+    std::memset(&record, 0, sizeof(record));
+    record.operation = operation;
+    std::memcpy(&record.key, &key, sizeof(Key));
+    std::memcpy(&record.value, &value, sizeof(Value));
+    record.checksum = checksumRecord(record);
+    pending_.push_back(record);
+    uint64_t mine = ++appended_;
+    std::vector<LogRecord> batch;
+    while (durable_ < mine)
+    {
+        if (failed_) throw std::runtime_error("DurableAVLTree: log write failed");
+        if (syncing_)
+        {
+            synced_.wait(lock);
+            continue;
+        }
+        syncing_ = true;
+        batch.swap(pending_);
+        uint64_t upTo = appended_;
+        lock.unlock();
+        bool ok = true;
+        try
+        {
+            writeAll(logFd_, batch.data(), batch.size() * sizeof(LogRecord), "log");
+            syncFile(logFd_, "log");
+        }
+        catch (...)
+        {
+            ok = false;
+        }
+        lock.lock();
+        syncing_ = false;
+        if (ok)
+        {
+            for (size_t i = 0; i < batch.size(); i++) apply(batch[i]);
+            durable_ = upTo;
+        }
+        else failed_ = true;
+        batch.clear();
+        synced_.notify_all();
+    }
+}
+
+template<class Key, class Value>
+bool DurableAVLTree<Key, Value>::find(const Key& key, Value& value) const
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    typename AVLTree<Key, Value>::iterator it = tree_.find(key);
+    if (it == tree_.end()) return false;
+    value = it->second;
+    return true;
+}
+
+template<class Key, class Value>
+size_t DurableAVLTree<Key, Value>::size() const
+{
+    std::lock_guard<std::mutex> lock(lock_);
+    return tree_.size();
+}
+
+/**
+* Copies the contents, writes the copy to a temporary file, fsyncs it and renames it over the
+* snapshot, then empties the log. Only the copy holds lock_; the file work runs with the log
+* marked busy, so find() carries on and writers queue their records in pending_ meanwhile.
+* tree_ holds exactly the records in the log, as only syncs change it, so the snapshot covers
+* the whole log, and the queued records go into the emptied log with the next sync.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::compact()
+{
+    std::unique_lock<std::mutex> lock(lock_);
+    while (syncing_) synced_.wait(lock);
+    if (failed_) throw std::runtime_error("DurableAVLTree: an earlier log write failed");
+
+    std::vector<SnapshotEntry> entries;
+    entries.reserve(tree_.size());
+    for (typename AVLTree<Key, Value>::iterator it = tree_.begin(); it != tree_.end(); ++it)
+    {
+        SnapshotEntry entry;
+        std::memset(&entry, 0, sizeof(entry));
+        std::memcpy(&entry.key, &it->first, sizeof(Key));
+        std::memcpy(&entry.value, &it->second, sizeof(Value));
+        entries.push_back(entry);
+    }
+    DurableAVLSnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.entrySize = sizeof(SnapshotEntry);
+    header.count = entries.size();
+    header.checksum = checksum(entries.data(), entries.size() * sizeof(SnapshotEntry));
+    syncing_ = true;
+    lock.unlock();
+
+    std::string temp = path_ + ".snap.tmp";
+    bool replaced = false; // Past this point a failure leaves the log in an unknown state
+    try
+    {
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw std::runtime_error("DurableAVLTree: cannot create " + temp + ": " + std::strerror(errno));
+        try
+        {
+            writeAll(fd, &header, sizeof(header), "snapshot");
+            writeAll(fd, entries.data(), entries.size() * sizeof(SnapshotEntry), "snapshot");
+            syncFile(fd, "snapshot");
+        }
+        catch (...)
+        {
+            ::close(fd);
+            ::unlink(temp.c_str());
+            throw;
+        }
+        ::close(fd);
+        if (::rename(temp.c_str(), (path_ + ".snap").c_str()) != 0) throw std::runtime_error(std::string("DurableAVLTree: cannot replace snapshot: ") + std::strerror(errno));
+        replaced = true;
+        syncDirectory(path_);
+        // The old log is still valid on top of the new snapshot, but appends would land at the wrong offset
+        if (::ftruncate(logFd_, 0) != 0 || ::lseek(logFd_, 0, SEEK_SET) < 0) throw std::runtime_error(std::string("DurableAVLTree: cannot empty log: ") + std::strerror(errno));
+        syncFile(logFd_, "log");
+    }
+    catch (...)
+    {
+        lock.lock();
+        syncing_ = false;
+        if (replaced) failed_ = true;
+        synced_.notify_all();
+        throw;
+    }
+    lock.lock();
+    syncing_ = false;
+    synced_.notify_all();
+}
+
+// 64-bit FNV-1a, enough to tell a torn or garbled record from an intact one
+template<class Key, class Value>
+uint64_t DurableAVLTree<Key, Value>::checksum(const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+template<class Key, class Value>
+uint64_t DurableAVLTree<Key, Value>::checksumRecord(const LogRecord& record)
+{
+    const char* start = reinterpret_cast<const char*>(&record) + sizeof(record.checksum);
+    return checksum(start, sizeof(LogRecord) - sizeof(record.checksum));
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::writeAll(int fd, const void* data, size_t size, const std::string& what)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t n = ::write(fd, bytes, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw std::runtime_error("DurableAVLTree: cannot write " + what + ": " + std::strerror(errno));
+        bytes += n;
+        size -= n;
+    }
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::syncFile(int fd, const std::string& what)
+{
+    if (::fsync(fd) != 0) throw std::runtime_error("DurableAVLTree: cannot fsync " + what + ": " + std::strerror(errno));
+}
+
+// Makes a rename in the directory holding path durable
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::syncDirectory(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("DurableAVLTree: cannot open " + directory + ": " + std::strerror(errno));
+    int result = ::fsync(fd);
+    ::close(fd);
+    if (result != 0) throw std::runtime_error("DurableAVLTree: cannot fsync " + directory + ": " + std::strerror(errno));
+}
+
+#endif
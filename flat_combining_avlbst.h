@@ -0,0 +1,272 @@
+#ifndef FLAT_COMBINING_AVLBST_H
+#define FLAT_COMBINING_AVLBST_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+/**
+* A thread-safe front end for an AVLTree using flat combining. Instead of every thread
+* taking a lock and walking the tree itself, a thread publishes its request in its own
+* slot and tries to become the combiner. The combiner collects every pending request,
+* sorts them by key and applies them in one pass, so the upper levels of the tree stay in
+* its cache and the lock changes hands once per batch instead of once per operation.
+* Waiting threads spin on their own slot and read a flag saying whether a combiner is at
+* work, and try the lock only when that flag is clear, so while a batch is applied they
+* write to no shared cache line. Threads whose request was applied by someone else never
+* touch the tree.
+*
+* Each thread gets a slot the first time it calls into a given tree and gives it back when
+* it exits, so at most maxThreads threads may use one tree at the same time. An exception
+* thrown while applying a request is rethrown in the thread that made it.
+*/
+template <class Key, class Value>
+class FlatCombiningAVLTree
+{
+public:
+    explicit FlatCombiningAVLTree(size_t maxThreads = 64);
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    // Copies the value of key into value and returns true, or returns false if key is missing
+    bool find(const Key& key, Value& value);
+
+protected:
+    enum Operation { kInsert, kRemove, kFind };
+
+    // A request slot. Padded to a cache line so threads polling their own slots do not
+    // invalidate each other
+    struct alignas(64) Slot
+    {
+        Slot() : pending(false), operation(kFind), found(false) {}
+        std::atomic<bool> pending; // Set by the owner when publishing, cleared by the combiner when done
+        Operation operation;
+        Key key;
+        Value value; // Input for kInsert, output for kFind
+        bool found; // Output for kFind
+        std::exception_ptr error; // Output, set if applying the request threw
+    };
+
+    // The indices of slots given back by exited threads. Shared with those threads, which
+    // may exit after the tree is gone
+    struct SlotPool
+    {
+        std::mutex lock;
+        std::vector<size_t> free;
+    };
+
+    // The slots a thread holds in the trees it has used, returned to their pools when it exits
+    struct ThreadSlots
+    {
+        struct Entry
+        {
+            size_t tree; // The tree's id_
+            size_t index;
+            std::weak_ptr<SlotPool> pool;
+        };
+
+        ~ThreadSlots();
+
+        std::vector<Entry> entries;
+    };
+
+    Slot& mySlot();
+    void execute(Slot& slot);
+    void combine();
+
+    std::mutex lock_; // Held by the combiner
+    alignas(64) std::atomic<bool> combining_; // Set while lock_ is held, so waiters can poll it without writing
+    AVLTree<Key, Value> tree_;
+    std::vector<Slot> slots_;
+    std::atomic<size_t> nextSlot_; // Slots below it have been handed out at some point
+    std::shared_ptr<SlotPool> pool_;
+    std::vector<Slot*> batch_; // Scratch space for the combiner, only touched with lock_ held
+    const size_t id_; // Tells trees apart in the per-thread slot cache
+
+    static std::atomic<size_t> nextId_;
+};
+
+template<class Key, class Value>
+std::atomic<size_t> FlatCombiningAVLTree<Key, Value>::nextId_(0);
+
+template<class Key, class Value>
+FlatCombiningAVLTree<Key, Value>::FlatCombiningAVLTree(size_t maxThreads) :
+    combining_(false), slots_(maxThreads), nextSlot_(0), pool_(std::make_shared<SlotPool>()), id_(nextId_++)
+{
+    batch_.reserve(maxThreads);
+}
+
+template<class Key, class Value>
+FlatCombiningAVLTree<Key, Value>::ThreadSlots::~ThreadSlots()
+{
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        std::shared_ptr<SlotPool> pool = entries[i].pool.lock();
+        if (!pool) continue; // The tree is gone
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->free.push_back(entries[i].index);
+    }
+}
+
+/**
+* Returns the calling thread's slot, claiming one on its first call. The thread's entries
+* are keyed by tree id rather than address, so a new tree at a recycled address is not
+* mistaken for an old one. The tree used last is kept first, so a thread working on one
+* tree finds its slot at once; entries of destroyed trees are dropped on the next claim.
+*/
+template<class Key, class Value>
+typename FlatCombiningAVLTree<Key, Value>::Slot& FlatCombiningAVLTree<Key, Value>::mySlot()
+{
+    thread_local ThreadSlots mine;
+    std::vector<typename ThreadSlots::Entry>& entries = mine.entries;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (entries[i].tree != id_) continue;
+        if (i > 0) std::swap(entries[0], entries[i]);
+        return slots_[entries[0].index];
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (!entries[i].pool.expired()) entries[kept++] = entries[i];
+    }
+    entries.resize(kept);
+    entries.reserve(kept + 1); // So the slot cannot be lost to a failed insert below
+    size_t index;
+    {
+        std::lock_guard<std::mutex> guard(pool_->lock);
+        if (!pool_->free.empty())
+        {
+            index = pool_->free.back();
+            pool_->free.pop_back();
+        }
+        else
+        {
+            index = nextSlot_.load(std::memory_order_relaxed);
+            if (index >= slots_.size()) throw std::length_error("FlatCombiningAVLTree: more threads than maxThreads");
+            nextSlot_.store(index + 1, std::memory_order_release);
+        }
+    }
+    typename ThreadSlots::Entry entry = { id_, index, pool_ };
+    entries.insert(entries.begin(), entry);
+    return slots_[index];
+}
+
+/**
+* Publishes the request in slot, then either waits for a combiner to apply it or becomes
+* the combiner itself. The lock is only tried when combining_ reads clear; a stale read
+* just makes try_lock() fail.
+*/
+template<class Key, class Value>
+void FlatCombiningAVLTree<Key, Value>::execute(Slot& slot)
+{
+    slot.error = std::exception_ptr();
+    slot.pending.store(true, std::memory_order_release);
+    while (slot.pending.load(std::memory_order_acquire))
+    {
+        if (!combining_.load(std::memory_order_relaxed))
+        {
+            std::unique_lock<std::mutex> guard(lock_, std::try_to_lock);
+            if (guard.owns_lock())
+            {
+                combining_.store(true, std::memory_order_relaxed);
+                combine(); // Our own request is among the pending ones
+                combining_.store(false, std::memory_order_relaxed);
+                break;
+            }
+        }
+        std::this_thread::yield();
+    }
+    if (slot.error) std::rethrow_exception(slot.error);
+}
+
+/**
+* Applies every pending request, sorted by key so consecutive operations walk mostly the
+* same path. Requests on the same key come from different threads, so they are concurrent
+* and any order between them is valid. Every collected request is completed even if
+* something throws, with the exception left in its slot, so no thread waits forever on a
+* request that was taken out of the queue. Must be called with lock_ held.
+*/
+template<class Key, class Value>
+void FlatCombiningAVLTree<Key, Value>::combine()
+{
+    batch_.clear();
+    size_t used = std::min(nextSlot_.load(std::memory_order_acquire), slots_.size());
+    for (size_t i = 0; i < used; i++)
+    {
+        if (slots_[i].pending.load(std::memory_order_acquire)) batch_.push_back(&slots_[i]);
+    }
+    try
+    {
+        std::sort(batch_.begin(), batch_.end(), [](const Slot* a, const Slot* b) { return a->key < b->key; });
+    }
+    catch (...) // A throwing comparison fails the whole batch
+    {
+        for (size_t i = 0; i < batch_.size(); i++)
+        {
+            batch_[i]->error = std::current_exception();
+            batch_[i]->pending.store(false, std::memory_order_release);
+        }
+        return;
+    }
+    for (size_t i = 0; i < batch_.size(); i++)
+    {
+        Slot& slot = *batch_[i];
+        try
+        {
+            if (slot.operation == kInsert) tree_.insert(std::make_pair(slot.key, slot.value));
+            else if (slot.operation == kRemove) tree_.remove(slot.key);
+            else
+            {
+                typename AVLTree<Key, Value>::iterator it = tree_.find(slot.key);
+                slot.found = it != tree_.end();
+                if (slot.found) slot.value = it->second;
+            }
+        }
+        catch (...)
+        {
+            slot.error = std::current_exception();
+        }
+        slot.pending.store(false, std::memory_order_release);
+    }
+}
+
+template<class Key, class Value>
+void FlatCombiningAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    Slot& slot = mySlot();
+    slot.operation = kInsert;
+    slot.key = keyValuePair.first;
+    slot.value = keyValuePair.second;
+    execute(slot);
+}
+
+template<class Key, class Value>
+void FlatCombiningAVLTree<Key, Value>::remove(const Key& key)
+{
+    Slot& slot = mySlot();
+    slot.operation = kRemove;
+    slot.key = key;
+    execute(slot);
+}
+
+template<class Key, class Value>
+bool FlatCombiningAVLTree<Key, Value>::find(const Key& key, Value& value)
+{
+    Slot& slot = mySlot();
+    slot.operation = kFind;
+    slot.key = key;
+    execute(slot);
+    if (slot.found) value = slot.value;
+    return slot.found;
+}
+
+#endif
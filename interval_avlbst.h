@@ -0,0 +1,80 @@
+#ifndef INTERVAL_AVLBST_H
+#define INTERVAL_AVLBST_H
+
+#include <limits>
+#include <vector>
+#include "aggregate_avlbst.h"
+
+/**
+* The aggregate policy behind IntervalTree: each subtree summary is the largest interval end
+* in it. Values are (end, payload) pairs.
+*/
+template <typename Key, typename Value>
+struct IntervalMaxEnd
+{
+    typedef Key value_type;
+    static Key identity() { return std::numeric_limits<Key>::lowest(); }
+    static Key lift(const Key&, const std::pair<Key, Value>& value) { return value.first; }
+    static Key combine(const Key& left, const Key& right) { return left < right ? right : left; }
+};
+
+/**
+* An interval tree of closed intervals [start, end], keyed by start. Every node also knows the
+* largest end in its subtree (kept up to date by AggregateAVLTree), so a query can skip any
+* subtree that ends before the query starts. There is one interval per start; inserting
+* another interval with the same start replaces it.
+* An iterator's first is the start, second.first the end and second.second the payload.
+*/
+template <class Key, class Value>
+class IntervalTree : public AggregateAVLTree<Key, std::pair<Key, Value>, IntervalMaxEnd<Key, Value> >
+{
+public:
+    typedef AggregateAVLTree<Key, std::pair<Key, Value>, IntervalMaxEnd<Key, Value> > Base;
+    typedef typename Base::iterator iterator;
+
+    void insert(const Key& start, const Key& end, const Value& value);
+    using Base::insert;
+
+    // Every interval intersecting [lo, hi], in order of start, in O(min(n, (k + 1) log n)) for k results
+    std::vector<iterator> overlapping(const Key& lo, const Key& hi) const;
+    // Every interval containing point
+    std::vector<iterator> stab(const Key& point) const;
+
+protected:
+    // Helper function for overlapping()
+    static void overlappingHelper(typename Base::ANode* node, const Key& lo, const Key& hi, std::vector<iterator>& result);
+};
+
+template<class Key, class Value>
+void IntervalTree<Key, Value>::insert(const Key& start, const Key& end, const Value& value)
+{
+    this->insert(std::make_pair(start, std::make_pair(end, value)));
+}
+
+template<class Key, class Value>
+void IntervalTree<Key, Value>::overlappingHelper(typename Base::ANode* node, const Key& lo, const Key& hi, std::vector<iterator>& result)
+{
+    // Nothing in this subtree reaches lo
+    if (!node || node->getSummary() < lo) return;
+    overlappingHelper(node->getLeft(), lo, hi, result);
+    // This interval and everything to its right start after hi
+    if (hi < node->getKey()) return;
+    if (!(node->getValue().first < lo)) result.push_back(Base::makeIterator(node));
+    overlappingHelper(node->getRight(), lo, hi, result);
+}
+
+template<class Key, class Value>
+std::vector<typename IntervalTree<Key, Value>::iterator> IntervalTree<Key, Value>::overlapping(const Key& lo, const Key& hi) const
+{
+    std::vector<iterator> result;
+    overlappingHelper(static_cast<typename Base::ANode*>(this->root_), lo, hi, result);
+    return result;
+}
+
+template<class Key, class Value>
+std::vector<typename IntervalTree<Key, Value>::iterator> IntervalTree<Key, Value>::stab(const Key& point) const
+{
+    return overlapping(point, point);
+}
+
+#endif
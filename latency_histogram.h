@@ -0,0 +1,188 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+
+/**
+* A histogram of latencies in nanoseconds with log-spaced buckets: every power of two is
+* split into kSubBuckets equal parts, so a reported percentile is within about 25% of the
+* true value from 1ns up to hours. Counters are atomic, so any number of threads can record
+* into the same histogram; reading while others record gives a slightly stale picture.
+*/
+class LatencyHistogram
+{
+public:
+    static const int kSubBits = 2;
+    static const int kSubBuckets = 1 << kSubBits;
+    static const int kBuckets = 64 * kSubBuckets;
+
+    LatencyHistogram() { reset(); }
+
+    void record(uint64_t nanoseconds)
+    {
+        counts_[bucketOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (nanoseconds > max && !max_.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {}
+    }
+
+    void reset()
+    {
+        for (int i = 0; i < kBuckets; i++) counts_[i].store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+    // The upper bound of the bucket holding the q-quantile (0 < q <= 1), capped at the maximum
+    uint64_t percentile(double q) const
+    {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * total);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; i++)
+        {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+            {
+                uint64_t bound = upperBoundOf(i);
+                return bound < max() ? bound : max();
+            }
+        }
+        return max();
+    }
+
+protected:
+    // Values below kSubBuckets get a bucket each; above that, the leading bit picks the octave
+    // and the next kSubBits bits the part of it
+    static int bucketOf(uint64_t value)
+    {
+        if (value < static_cast<uint64_t>(kSubBuckets)) return static_cast<int>(value);
+        int octave = 63;
+        while (!(value >> octave)) octave--;
+        int sub = static_cast<int>((value >> (octave - kSubBits)) & (kSubBuckets - 1));
+        return (octave - kSubBits + 1) * kSubBuckets + sub;
+    }
+
+    static uint64_t upperBoundOf(int bucket)
+    {
+        if (bucket < kSubBuckets) return bucket;
+        int octave = bucket / kSubBuckets + kSubBits - 1;
+        uint64_t sub = bucket % kSubBuckets;
+        uint64_t step = static_cast<uint64_t>(1) << (octave - kSubBits);
+        return (static_cast<uint64_t>(1) << octave) + (sub + 1) * step - 1;
+    }
+
+    std::atomic<uint64_t> counts_[kBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> max_;
+};
+
+/**
+* Latency histograms of the tree operations, split by operation and by the size of the tree
+* at the time (one class per power of ten). Recorded by the trees when they are compiled
+* with AVL_LATENCY_HISTOGRAMS defined; the histograms are shared by every tree in the
+* process. The flag changes what the tree functions compile to, so it must be the same in
+* every translation unit.
+*/
+class AVLLatency
+{
+public:
+    enum Operation { kInsert, kRemove, kPop, kClear, kOperations };
+    static const int kSizeClasses = 12; // <10, <100, ..., >=1e10, and a last one for sizes not known at the time
+
+    static LatencyHistogram& histogram(Operation operation, int sizeClass)
+    {
+        return instance().histograms_[operation][sizeClass];
+    }
+
+    static int sizeClassOf(size_t size)
+    {
+        if (size == static_cast<size_t>(-1)) return kSizeClasses - 1;
+        int sizeClass = 0;
+        while (size >= 10 && sizeClass < kSizeClasses - 2)
+        {
+            size /= 10;
+            sizeClass++;
+        }
+        return sizeClass;
+    }
+
+    static void reset()
+    {
+        for (int op = 0; op < kOperations; op++)
+        {
+            for (int c = 0; c < kSizeClasses; c++) instance().histograms_[op][c].reset();
+        }
+    }
+
+    // One line per non-empty histogram: operation, size class, count, p50, p99, p99.9 and max in nanoseconds
+    static void report(std::ostream& out)
+    {
+        static const char* const names[kOperations] = { "insert", "remove", "pop", "clear" };
+        char line[160];
+        std::snprintf(line, sizeof(line), "%-8s %-10s %12s %10s %10s %10s %12s\n", "op", "size", "count", "p50", "p99", "p99.9", "max");
+        out << line;
+        for (int op = 0; op < kOperations; op++)
+        {
+            for (int c = 0; c < kSizeClasses; c++)
+            {
+                const LatencyHistogram& h = instance().histograms_[op][c];
+                if (!h.count()) continue;
+                char size[16];
+                if (c == kSizeClasses - 1) std::snprintf(size, sizeof(size), "unknown");
+                else if (c == kSizeClasses - 2) std::snprintf(size, sizeof(size), ">=1e%d", c);
+                else std::snprintf(size, sizeof(size), "<1e%d", c + 1);
+                std::snprintf(line, sizeof(line), "%-8s %-10s %12llu %10llu %10llu %10llu %12llu\n", names[op], size,
+                    static_cast<unsigned long long>(h.count()), static_cast<unsigned long long>(h.percentile(0.5)),
+                    static_cast<unsigned long long>(h.percentile(0.99)), static_cast<unsigned long long>(h.percentile(0.999)),
+                    static_cast<unsigned long long>(h.max()));
+                out << line;
+            }
+        }
+    }
+
+protected:
+    static AVLLatency& instance()
+    {
+        static AVLLatency latency;
+        return latency;
+    }
+
+    LatencyHistogram histograms_[kOperations][kSizeClasses];
+};
+
+/**
+* Times its own lifetime and records it under an operation and the tree size it was given.
+*/
+class AVLLatencyScope
+{
+public:
+    AVLLatencyScope(AVLLatency::Operation operation, size_t size) :
+        operation_(operation), sizeClass_(AVLLatency::sizeClassOf(size)), start_(std::chrono::steady_clock::now()) {}
+
+    ~AVLLatencyScope()
+    {
+        std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start_;
+        AVLLatency::histogram(operation_, sizeClass_).record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+protected:
+    AVLLatencyScope(const AVLLatencyScope&);
+    AVLLatencyScope& operator=(const AVLLatencyScope&);
+
+    AVLLatency::Operation operation_;
+    int sizeClass_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#endif
@@ -0,0 +1,599 @@
+#ifndef MAPPED_AVLBST_H
+#define MAPPED_AVLBST_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+* The header stored at offset 0 of every mapped AVL file. Offsets are relative to the
+* start of the mapping, so offset 0 (the header itself) doubles as the NULL link.
+*/
+struct MappedAVLHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nodeSize; // sizeof the node type, to reject files written with other Key/Value types
+    uint64_t root;
+    uint64_t size; // Number of keys stored
+    uint64_t capacity; // Size of the file in bytes
+    uint64_t bump; // Offset of the first never-used byte
+    uint64_t freeList; // Offset of the first freed node, chained through left
+};
+
+/**
+* A node of the mapped AVL tree. It holds no pointers, only offsets into the mapping,
+* so the file can be mapped at any address without any fixups.
+*/
+template <typename Key, typename Value>
+struct MappedAVLNode
+{
+    Key key;
+    Value value;
+    uint64_t parent;
+    uint64_t left;
+    uint64_t right;
+    int32_t height;
+};
+
+/**
+* An AVL tree whose nodes live in a memory-mapped file. Opening an existing file only maps it
+* and validates the header, so the tree is usable immediately and a lookup only faults in the
+* pages of the nodes on its search path. Changes reach the file through the OS page cache;
+* call sync() to force them to disk. There is no journaling, so a crash between two sync()
+* calls may leave the file inconsistent.
+* Key and Value are stored byte-for-byte, so they must be trivially copyable.
+*/
+template <typename Key, typename Value>
+class MappedAVLTree
+{
+    static_assert(std::is_trivially_copyable<Key>::value, "MappedAVLTree keys must be trivially copyable");
+    static_assert(std::is_trivially_copyable<Value>::value, "MappedAVLTree values must be trivially copyable");
+
+    typedef MappedAVLNode<Key, Value> MNode;
+
+public:
+    MappedAVLTree(const std::string& path, uint64_t initialCapacity = 1 << 20);
+    ~MappedAVLTree();
+
+    void insert(const std::pair<const Key, Value>& new_item);
+    void remove(const Key& key);
+    void sync();
+    bool empty() const;
+    uint64_t size() const;
+
+    /**
+    * An iterator over the mapped tree. It stores an offset rather than a pointer so it
+    * survives the remapping done when the file grows. Dereferencing yields a pair of
+    * references into the mapping.
+    */
+    class iterator
+    {
+    public:
+        iterator();
+
+        std::pair<const Key&, Value&> operator*() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class MappedAVLTree<Key, Value>;
+        iterator(const MappedAVLTree<Key, Value>* tree, uint64_t offset);
+        const MappedAVLTree<Key, Value>* tree_;
+        uint64_t current_;
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+
+private:
+    MappedAVLTree(const MappedAVLTree&);
+    MappedAVLTree& operator=(const MappedAVLTree&);
+
+    MappedAVLHeader* header() const;
+    MNode* at(uint64_t offset) const;
+    uint64_t firstNodeOffset() const;
+    void map(uint64_t capacity);
+    void grow();
+    uint64_t allocateNode();
+    void freeNode(uint64_t offset);
+
+    uint64_t internalFind(const Key& key) const;
+    int height(uint64_t offset) const;
+    void leftRotate(uint64_t node);
+    void rightRotate(uint64_t node);
+    void updateHeights(uint64_t node);
+    int calculateBF(uint64_t node) const;
+    int findXYZ(uint64_t& x, uint64_t& y, uint64_t& z, uint64_t start) const;
+    void balance(uint64_t x, uint64_t y, uint64_t z, int balanceMode);
+    void replaceChild(uint64_t parent, uint64_t oldChild, uint64_t newChild);
+
+    static const uint64_t kMagic = 0x4c564154504d5641ULL; // "AVMPTAVL"
+    static const uint32_t kVersion = 1;
+
+    int fd_;
+    char* base_;
+    uint64_t mapped_; // Length of the current mapping
+};
+
+/*
+  ----------------------------------------------------
+  Begin implementations for the MappedAVLTree::iterator.
+  ----------------------------------------------------
+*/
+
+template<class Key, class Value>
+MappedAVLTree<Key, Value>::iterator::iterator() : tree_(NULL), current_(0)
+{
+}
+
+template<class Key, class Value>
+MappedAVLTree<Key, Value>::iterator::iterator(const MappedAVLTree<Key, Value>* tree, uint64_t offset) :
+    tree_(tree), current_(offset)
+{
+}
+
+template<class Key, class Value>
+std::pair<const Key&, Value&> MappedAVLTree<Key, Value>::iterator::operator*() const
+{
+    MNode* node = tree_->at(current_);
+    return std::pair<const Key&, Value&>(node->key, node->value);
+}
+
+template<class Key, class Value>
+bool MappedAVLTree<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+    return current_ == rhs.current_;
+}
+
+template<class Key, class Value>
+bool MappedAVLTree<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+    return current_ != rhs.current_;
+}
+
+/**
+* Advances to the in-order successor, the same way as BinarySearchTree::iterator but on offsets.
+*/
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator& MappedAVLTree<Key, Value>::iterator::operator++()
+{
+    if (!current_) return *this;
+    MNode* node = tree_->at(current_);
+    if (node->right) // Successor is the leftmost node of the right subtree
+    {
+        current_ = node->right;
+        while (tree_->at(current_)->left) current_ = tree_->at(current_)->left;
+        return *this;
+    }
+    // Otherwise go up until we come from a left child
+    while (node->parent && tree_->at(node->parent)->right == current_)
+    {
+        current_ = node->parent;
+        node = tree_->at(current_);
+    }
+    current_ = node->parent;
+    return *this;
+}
+
+/*
+  --------------------------------------------------
+  End implementations for the MappedAVLTree::iterator.
+  --------------------------------------------------
+*/
+
+/**
+* Opens the file at path, creating and formatting it if it does not exist or is empty.
+* An existing file is only mapped and its header checked; nothing is read eagerly.
+*/
+template<class Key, class Value>
+MappedAVLTree<Key, Value>::MappedAVLTree(const std::string& path, uint64_t initialCapacity) :
+    fd_(-1), base_(NULL), mapped_(0)
+{
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0) throw std::runtime_error("MappedAVLTree: cannot open " + path + ": " + std::strerror(errno));
+    struct stat st;
+    if (::fstat(fd_, &st) != 0)
+    {
+        ::close(fd_);
+        throw std::runtime_error("MappedAVLTree: cannot stat " + path + ": " + std::strerror(errno));
+    }
+    try
+    {
+        if (st.st_size == 0) // New file, format it
+        {
+            uint64_t capacity = std::max<uint64_t>(initialCapacity, firstNodeOffset() + sizeof(MNode));
+            if (::ftruncate(fd_, capacity) != 0) throw std::runtime_error(std::string("MappedAVLTree: cannot size file: ") + std::strerror(errno));
+            map(capacity);
+            MappedAVLHeader* h = header();
+            h->magic = kMagic;
+            h->version = kVersion;
+            h->nodeSize = sizeof(MNode);
+            h->root = 0;
+            h->size = 0;
+            h->capacity = capacity;
+            h->bump = firstNodeOffset();
+            h->freeList = 0;
+        }
+        else // Existing file, map it and make sure it was written with the same layout
+        {
+            if ((uint64_t)st.st_size < sizeof(MappedAVLHeader)) throw std::runtime_error("MappedAVLTree: " + path + " is too small");
+            map(st.st_size);
+            MappedAVLHeader* h = header();
+            if (h->magic != kMagic || h->version != kVersion) throw std::runtime_error("MappedAVLTree: " + path + " is not a mapped AVL file");
+            if (h->nodeSize != sizeof(MNode)) throw std::runtime_error("MappedAVLTree: " + path + " was written with different key/value types");
+            if (h->capacity > (uint64_t)st.st_size) throw std::runtime_error("MappedAVLTree: " + path + " is truncated");
+            h->capacity = st.st_size; // Larger if a grow() was cut short before it recorded the new size
+        }
+    }
+    catch (...)
+    {
+        if (base_) ::munmap(base_, mapped_);
+        ::close(fd_);
+        throw;
+    }
+}
+
+/**
+* Unmaps the file. Dirty pages are written back by the OS; call sync() first if they
+* must be on disk before returning.
+*/
+template<class Key, class Value>
+MappedAVLTree<Key, Value>::~MappedAVLTree()
+{
+    if (base_) ::munmap(base_, mapped_);
+    if (fd_ >= 0) ::close(fd_);
+}
+
+template<class Key, class Value>
+MappedAVLHeader* MappedAVLTree<Key, Value>::header() const
+{
+    return reinterpret_cast<MappedAVLHeader*>(base_);
+}
+
+/**
+* Translates an offset into a pointer into the current mapping, or NULL for offset 0.
+* Pointers must not be kept across allocateNode(), which may remap the file.
+*/
+template<class Key, class Value>
+MappedAVLNode<Key, Value>* MappedAVLTree<Key, Value>::at(uint64_t offset) const
+{
+    return offset ? reinterpret_cast<MNode*>(base_ + offset) : NULL;
+}
+
+template<class Key, class Value>
+uint64_t MappedAVLTree<Key, Value>::firstNodeOffset() const
+{
+    // Round the header up so every node is suitably aligned
+    return (sizeof(MappedAVLHeader) + alignof(MNode) - 1) / alignof(MNode) * alignof(MNode);
+}
+
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::map(uint64_t capacity)
+{
+    void* mem = ::mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (mem == MAP_FAILED) throw std::runtime_error(std::string("MappedAVLTree: mmap failed: ") + std::strerror(errno));
+    base_ = static_cast<char*>(mem);
+    mapped_ = capacity;
+}
+
+/**
+* Doubles the file and maps it again. Every offset stays valid, every pointer does not.
+* The new size is made durable before the header records it, so the header never claims
+* more than the file holds; opening a file that is larger than its header says finishes
+* an interrupted grow().
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::grow()
+{
+    uint64_t oldCapacity = header()->capacity;
+    uint64_t newCapacity = oldCapacity * 2;
+    if (::ftruncate(fd_, newCapacity) != 0) throw std::runtime_error(std::string("MappedAVLTree: cannot grow file: ") + std::strerror(errno));
+    if (::fsync(fd_) != 0) throw std::runtime_error(std::string("MappedAVLTree: cannot fsync file: ") + std::strerror(errno));
+    ::munmap(base_, mapped_);
+    base_ = NULL;
+    map(newCapacity);
+    header()->capacity = newCapacity;
+}
+
+template<class Key, class Value>
+uint64_t MappedAVLTree<Key, Value>::allocateNode()
+{
+    MappedAVLHeader* h = header();
+    if (h->freeList) // Reuse a freed node first
+    {
+        uint64_t offset = h->freeList;
+        h->freeList = at(offset)->left;
+        return offset;
+    }
+    if (h->bump + sizeof(MNode) > h->capacity) grow();
+    h = header(); // grow() remaps
+    uint64_t offset = h->bump;
+    h->bump += sizeof(MNode);
+    return offset;
+}
+
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::freeNode(uint64_t offset)
+{
+    at(offset)->left = header()->freeList;
+    header()->freeList = offset;
+}
+
+/**
+* Flushes every dirty page of the mapping to the file and waits for it.
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::sync()
+{
+    if (::msync(base_, mapped_, MS_SYNC) != 0) throw std::runtime_error(std::string("MappedAVLTree: msync failed: ") + std::strerror(errno));
+}
+
+template<class Key, class Value>
+bool MappedAVLTree<Key, Value>::empty() const
+{
+    return header()->root == 0;
+}
+
+template<class Key, class Value>
+uint64_t MappedAVLTree<Key, Value>::size() const
+{
+    return header()->size;
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator MappedAVLTree<Key, Value>::begin() const
+{
+    uint64_t node = header()->root;
+    if (node) while (at(node)->left) node = at(node)->left; // Go all the way left
+    return iterator(this, node);
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator MappedAVLTree<Key, Value>::end() const
+{
+    return iterator(this, 0);
+}
+
+template<class Key, class Value>
+typename MappedAVLTree<Key, Value>::iterator MappedAVLTree<Key, Value>::find(const Key& key) const
+{
+    return iterator(this, internalFind(key));
+}
+
+template<class Key, class Value>
+uint64_t MappedAVLTree<Key, Value>::internalFind(const Key& key) const
+{
+    uint64_t node = header()->root;
+    while (node)
+    {
+        MNode* n = at(node);
+        if (key == n->key) return node;
+        node = key < n->key ? n->left : n->right;
+    }
+    return 0;
+}
+
+template<class Key, class Value>
+int MappedAVLTree<Key, Value>::height(uint64_t offset) const
+{
+    return offset ? at(offset)->height : 0;
+}
+
+// Points parent's link to oldChild at newChild instead, or the root if there is no parent
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::replaceChild(uint64_t parent, uint64_t oldChild, uint64_t newChild)
+{
+    if (!parent) header()->root = newChild;
+    else if (at(parent)->left == oldChild) at(parent)->left = newChild;
+    else at(parent)->right = newChild;
+    if (newChild) at(newChild)->parent = parent;
+}
+
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::leftRotate(uint64_t node)
+{
+    MNode* n = at(node);
+    uint64_t rightChild = n->right;
+    MNode* r = at(rightChild);
+    uint64_t rightLeftChild = r->left; // Becomes the rotated node's right subtree
+    n->right = rightLeftChild;
+    if (rightLeftChild) at(rightLeftChild)->parent = node;
+    replaceChild(n->parent, node, rightChild);
+    r->left = node;
+    n->parent = rightChild;
+}
+
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::rightRotate(uint64_t node)
+{
+    MNode* n = at(node);
+    uint64_t leftChild = n->left;
+    MNode* l = at(leftChild);
+    uint64_t leftRightChild = l->right; // Becomes the rotated node's left subtree
+    n->left = leftRightChild;
+    if (leftRightChild) at(leftRightChild)->parent = node;
+    replaceChild(n->parent, node, leftChild);
+    l->right = node;
+    n->parent = leftChild;
+}
+
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::updateHeights(uint64_t node)
+{
+    while (node) // Until we have gone past the root
+    {
+        MNode* n = at(node);
+        n->height = std::max(height(n->left), height(n->right)) + 1;
+        node = n->parent;
+    }
+}
+
+template<class Key, class Value>
+int MappedAVLTree<Key, Value>::calculateBF(uint64_t node) const
+{
+    return std::abs(height(at(node)->right) - height(at(node)->left));
+}
+
+/**
+* Same as AVLTree::findXYZ: z is the unbalanced node, y its taller child and x y's taller
+* child, with ties broken towards a straight line.
+*/
+template<class Key, class Value>
+int MappedAVLTree<Key, Value>::findXYZ(uint64_t& x, uint64_t& y, uint64_t& z, uint64_t start) const
+{
+    z = start;
+    bool firstLeft = height(at(z)->left) > height(at(z)->right);
+    y = firstLeft ? at(z)->left : at(z)->right;
+    int leftHeight = height(at(y)->left);
+    int rightHeight = height(at(y)->right);
+    bool secondLeft = leftHeight > rightHeight || (leftHeight == rightHeight && firstLeft);
+    x = secondLeft ? at(y)->left : at(y)->right;
+    if (firstLeft && secondLeft) return 2; // First left then left
+    else if (!firstLeft && !secondLeft) return 1; // First right then right
+    else if (firstLeft && !secondLeft) return 3; // First left then right
+    else return 4; // First right then left
+}
+
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::balance(uint64_t x, uint64_t y, uint64_t z, int balanceMode)
+{
+    if (balanceMode == 1) // Single left
+    {
+        leftRotate(z);
+        updateHeights(x);
+        updateHeights(z);
+    }
+    else if (balanceMode == 2) // Single right
+    {
+        rightRotate(z);
+        updateHeights(x);
+        updateHeights(z);
+    }
+    else if (balanceMode == 3) // Left then right
+    {
+        leftRotate(y);
+        rightRotate(z);
+        updateHeights(y);
+        updateHeights(z);
+    }
+    else if (balanceMode == 4) // Right then left
+    {
+        rightRotate(y);
+        leftRotate(z);
+        updateHeights(y);
+        updateHeights(z);
+    }
+}
+
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& new_item)
+{
+    uint64_t node = header()->root;
+    uint64_t parent = 0;
+    bool lastDirection = false; // false means left, true means right
+    while (node)
+    {
+        parent = node;
+        MNode* n = at(node);
+        if (new_item.first < n->key) // If smaller, go left
+        {
+            node = n->left;
+            lastDirection = false;
+        }
+        else if (new_item.first == n->key) // If same key, update value
+        {
+            n->value = new_item.second;
+            return;
+        }
+        else // If larger, go right
+        {
+            node = n->right;
+            lastDirection = true;
+        }
+    }
+    uint64_t newNode = allocateNode(); // May remap, so only offsets are held across it
+    MNode* n = at(newNode);
+    n->key = new_item.first;
+    n->value = new_item.second;
+    n->parent = parent;
+    n->left = 0;
+    n->right = 0;
+    n->height = 1;
+    if (!parent) header()->root = newNode;
+    else if (lastDirection) at(parent)->right = newNode;
+    else at(parent)->left = newNode;
+    header()->size++;
+
+    // After an insertion a single (or double) rotation at the first unbalanced ancestor is enough
+    updateHeights(parent);
+    for (uint64_t temp = parent; temp; temp = at(temp)->parent)
+    {
+        if (calculateBF(temp) >= 2)
+        {
+            uint64_t x, y, z;
+            int balanceMode = findXYZ(x, y, z, temp);
+            balance(x, y, z, balanceMode);
+            break;
+        }
+    }
+}
+
+/**
+* Removes key if present. A node with two children takes over its predecessor's key and value
+* and the predecessor's node is unlinked instead, which is cheaper than swapping positions on
+* disk; iterators to the predecessor are invalidated.
+*/
+template<class Key, class Value>
+void MappedAVLTree<Key, Value>::remove(const Key& key)
+{
+    uint64_t target = internalFind(key);
+    if (!target) return;
+    if (at(target)->left && at(target)->right) // 2 children, move the predecessor up
+    {
+        uint64_t predecessor = at(target)->left;
+        while (at(predecessor)->right) predecessor = at(predecessor)->right;
+        at(target)->key = at(predecessor)->key;
+        at(target)->value = at(predecessor)->value;
+        target = predecessor;
+    }
+    // Now target has at most one child, splice it out
+    MNode* t = at(target);
+    uint64_t child = t->left ? t->left : t->right;
+    uint64_t parent = t->parent;
+    replaceChild(parent, target, child);
+    freeNode(target);
+    header()->size--;
+
+    // The tree may be unbalanced at every ancestor after a removal, so keep going up
+    updateHeights(parent);
+    uint64_t temp = parent;
+    while (temp)
+    {
+        if (calculateBF(temp) >= 2)
+        {
+            uint64_t x, y, z;
+            int balanceMode = findXYZ(x, y, z, temp);
+            temp = (balanceMode == 1 || balanceMode == 2) ? y : x; // The new root of the subtree
+            balance(x, y, z, balanceMode);
+        }
+        temp = at(temp)->parent;
+    }
+}
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef MERKLE_AVLBST_H
+#define MERKLE_AVLBST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include "aggregate_avlbst.h"
+
+/**
+* The summary kept by MerkleAVLTree: a polynomial hash of the entries of a subtree, in key
+* order, modulo the Mersenne prime 2^61 - 1. power is kBase^(number of entries), which is
+* what the hash of a left range has to be shifted by when a right range is appended.
+*/
+struct MerkleHash
+{
+    uint64_t hash;
+    uint64_t power;
+
+    bool operator==(const MerkleHash& rhs) const { return hash == rhs.hash && power == rhs.power; }
+    bool operator!=(const MerkleHash& rhs) const { return !(*this == rhs); }
+};
+
+/**
+* The aggregate policy behind MerkleAVLTree. The hash of a range only depends on the entries
+* in it, not on the shape of the subtrees that hold them, so two trees with the same contents
+* have the same summaries over every key range however they were built or balanced.
+* This detects accidental divergence; it is not meant to resist deliberately forged entries.
+*/
+template <typename Key, typename Value, typename KeyHash = std::hash<Key>, typename ValueHash = std::hash<Value> >
+struct MerkleAggregate
+{
+    typedef MerkleHash value_type;
+
+    static const uint64_t kPrime = (static_cast<uint64_t>(1) << 61) - 1;
+    static const uint64_t kBase = 0x1ae2c0d6b4f38a75ULL % kPrime;
+
+    static MerkleHash identity() { MerkleHash h = { 0, 1 }; return h; }
+    static MerkleHash lift(const Key& key, const Value& value)
+    {
+        // std::hash of an integer is usually the integer itself, so the two are mixed before use
+        uint64_t mixed = mix(mix(KeyHash()(key)) ^ ValueHash()(value));
+        MerkleHash h = { mixed % kPrime, kBase };
+        return h;
+    }
+    static MerkleHash combine(const MerkleHash& left, const MerkleHash& right)
+    {
+        MerkleHash h = { add(multiply(left.hash, right.power), right.hash), multiply(left.power, right.power) };
+        return h;
+    }
+
+    // The splitmix64 finalizer
+    static uint64_t mix(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    static uint64_t add(uint64_t a, uint64_t b)
+    {
+        uint64_t sum = a + b;
+        return sum >= kPrime ? sum - kPrime : sum;
+    }
+
+    // a * b mod 2^61 - 1 for a, b < 2^61, folding the high bits of the product back in since 2^61 = 1
+    static uint64_t multiply(uint64_t a, uint64_t b)
+    {
+#ifdef __SIZEOF_INT128__
+        unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        uint64_t low = static_cast<uint64_t>(product) & kPrime;
+        uint64_t high = static_cast<uint64_t>(product >> 61);
+#else
+        // Schoolbook product from 32-bit halves: a * b = hh * 2^64 + mid * 2^32 + ll
+        uint64_t aLow = a & 0xffffffffULL, aHigh = a >> 32;
+        uint64_t bLow = b & 0xffffffffULL, bHigh = b >> 32;
+        uint64_t ll = aLow * bLow, mid = aLow * bHigh + aHigh * bLow, hh = aHigh * bHigh;
+        // 2^64 = 8 and 2^61 = 1 mod kPrime; mid < 2^62, split at bit 29 so mid * 2^32 folds cleanly
+        uint64_t low = (ll & kPrime) + ((mid & ((1ULL << 29) - 1)) << 32);
+        uint64_t high = (ll >> 61) + (mid >> 29) + (hh << 3);
+#endif
+        return add(low % kPrime, high % kPrime);
+    }
+};
+
+/**
+* An AVL tree whose subtrees carry Merkle-style hashes of their entries, for checking
+* replicas against each other without streaming every entry. digest() is the hash of the
+* whole tree in O(1), and diff() finds the keys two trees disagree on by descending only
+* into the ranges whose hashes differ, so its cost grows with the number of differences
+* rather than with the size of the trees. Keys and values are hashed with KeyHash and
+* ValueHash, which must agree between the replicas (std::hash only does within one build).
+* As in AggregateAVLTree, values must be changed through insert() so the hashes stay current.
+*/
+template <class Key, class Value, class KeyHash = std::hash<Key>, class ValueHash = std::hash<Value> >
+class MerkleAVLTree : public AggregateAVLTree<Key, Value, MerkleAggregate<Key, Value, KeyHash, ValueHash> >
+{
+public:
+    typedef MerkleAggregate<Key, Value, KeyHash, ValueHash> Aggregate;
+    typedef AggregateAVLTree<Key, Value, Aggregate> Base;
+    typedef typename Base::ANode ANode;
+
+    // Equal for trees with equal contents, in O(1)
+    uint64_t digest() const;
+    // Calls f(key) in increasing order for every key that only one tree has or that maps to different values
+    template <typename F> void diff(const MerkleAVLTree<Key, Value, KeyHash, ValueHash>& other, F f) const;
+
+protected:
+    // Bounds are exclusive, a NULL bound leaves that side of the range open
+    MerkleHash rangeHash(const Key* lo, const Key* hi) const;
+    static MerkleHash hashAbove(ANode* node, const Key& lo);
+    static MerkleHash hashBelow(ANode* node, const Key& hi);
+    template <typename F> void diffHelper(ANode* node, const Key* lo, const Key* hi, const MerkleAVLTree<Key, Value, KeyHash, ValueHash>& other, F& f) const;
+    template <typename F> static void visitRange(ANode* node, const Key* lo, const Key* hi, F& f);
+};
+
+template<class Key, class Value, class KeyHash, class ValueHash>
+uint64_t MerkleAVLTree<Key, Value, KeyHash, ValueHash>::digest() const
+{
+    MerkleHash h = this->aggregate();
+    return Aggregate::mix(h.hash ^ Aggregate::mix(h.power));
+}
+
+/**
+* Walks this tree from the root. The subtree of a node holds exactly this tree's keys
+* between the keys of its nearest ancestors on either side, so it is compared with the hash
+* of the same open key range in other, which takes O(log n). Matching ranges are skipped
+* whole; for a mismatch the node's own key is checked and both subtrees are searched, so
+* d differences cost O(d log^2 n) instead of a full scan.
+*/
+template<class Key, class Value, class KeyHash, class ValueHash>
+template<typename F>
+void MerkleAVLTree<Key, Value, KeyHash, ValueHash>::diff(const MerkleAVLTree<Key, Value, KeyHash, ValueHash>& other, F f) const
+{
+    diffHelper(static_cast<ANode*>(this->root_), NULL, NULL, other, f);
+}
+
+template<class Key, class Value, class KeyHash, class ValueHash>
+template<typename F>
+void MerkleAVLTree<Key, Value, KeyHash, ValueHash>::diffHelper(ANode* node, const Key* lo, const Key* hi,
+    const MerkleAVLTree<Key, Value, KeyHash, ValueHash>& other, F& f) const
+{
+    MerkleHash theirs = other.rangeHash(lo, hi);
+    if (Base::summaryOf(node) == theirs) return;
+    if (!node) // Every key other has in the range is missing here
+    {
+        visitRange(static_cast<ANode*>(other.root_), lo, hi, f);
+        return;
+    }
+    if (theirs.power == 1) // other has nothing in the range, so every key here is missing there
+    {
+        visitRange(node, lo, hi, f);
+        return;
+    }
+    diffHelper(node->getLeft(), lo, &node->getKey(), other, f);
+    Node<Key, Value>* match = other.internalFind(node->getKey());
+    if (!match || !(match->getValue() == node->getValue())) f(node->getKey());
+    diffHelper(node->getRight(), &node->getKey(), hi, other, f);
+}
+
+// Calls f(key) in order for the keys of the subtree strictly between lo and hi
+template<class Key, class Value, class KeyHash, class ValueHash>
+template<typename F>
+void MerkleAVLTree<Key, Value, KeyHash, ValueHash>::visitRange(ANode* node, const Key* lo, const Key* hi, F& f)
+{
+    while (node)
+    {
+        if (lo && !(*lo < node->getKey())) node = node->getRight(); // node and its left subtree are out of range
+        else if (hi && !(node->getKey() < *hi)) node = node->getLeft();
+        else
+        {
+            visitRange(node->getLeft(), lo, NULL, f);
+            f(node->getKey());
+            node = node->getRight();
+            lo = NULL; // Everything in the right subtree is above lo
+        }
+    }
+}
+
+/**
+* Like AggregateAVLTree::aggregate(lo, hi), but with exclusive and optional bounds: finds the
+* highest node inside the range and combines the boundary paths below it.
+*/
+template<class Key, class Value, class KeyHash, class ValueHash>
+MerkleHash MerkleAVLTree<Key, Value, KeyHash, ValueHash>::rangeHash(const Key* lo, const Key* hi) const
+{
+    ANode* node = static_cast<ANode*>(this->root_);
+    while (node)
+    {
+        if (hi && !(node->getKey() < *hi)) node = node->getLeft();
+        else if (lo && !(*lo < node->getKey())) node = node->getRight();
+        else break;
+    }
+    if (!node) return Aggregate::identity();
+    MerkleHash result = lo ? hashAbove(node->getLeft(), *lo) : Base::summaryOf(node->getLeft());
+    result = Aggregate::combine(result, Aggregate::lift(node->getKey(), node->getValue()));
+    return Aggregate::combine(result, hi ? hashBelow(node->getRight(), *hi) : Base::summaryOf(node->getRight()));
+}
+
+// Hash of every key > lo in the subtree, the strict version of AggregateAVLTree::aggregateFrom()
+template<class Key, class Value, class KeyHash, class ValueHash>
+MerkleHash MerkleAVLTree<Key, Value, KeyHash, ValueHash>::hashAbove(ANode* node, const Key& lo)
+{
+    MerkleHash result = Aggregate::identity();
+    while (node)
+    {
+        if (!(lo < node->getKey())) node = node->getRight();
+        else
+        {
+            MerkleHash inRange = Aggregate::combine(Aggregate::lift(node->getKey(), node->getValue()), Base::summaryOf(node->getRight()));
+            result = Aggregate::combine(inRange, result);
+            node = node->getLeft();
+        }
+    }
+    return result;
+}
+
+// Hash of every key < hi in the subtree, the mirror image of hashAbove()
+template<class Key, class Value, class KeyHash, class ValueHash>
+MerkleHash MerkleAVLTree<Key, Value, KeyHash, ValueHash>::hashBelow(ANode* node, const Key& hi)
+{
+    MerkleHash result = Aggregate::identity();
+    while (node)
+    {
+        if (!(node->getKey() < hi)) node = node->getLeft();
+        else
+        {
+            MerkleHash inRange = Aggregate::combine(Base::summaryOf(node->getLeft()), Aggregate::lift(node->getKey(), node->getValue()));
+            result = Aggregate::combine(result, inRange);
+            node = node->getRight();
+        }
+    }
+    return result;
+}
+
+#endif
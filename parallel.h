@@ -0,0 +1,112 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+
+/**
+* Returns how many levels of fork-join recursion are needed to keep the given number of
+* threads busy (i.e. ceil(log2(threads))). 0 threads means one per hardware thread.
+*/
+inline int parallelDepth(unsigned threads)
+{
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    int depth = 0;
+    while ((1u << depth) < threads) depth++;
+    return depth;
+}
+
+// The threads forked by parallelInvoke() that are still running, across the whole process
+inline std::atomic<unsigned>& parallelWorkers()
+{
+    static std::atomic<unsigned> workers(0);
+    return workers;
+}
+
+/**
+* Claims one of the hardware threads left over besides the calling one and returns whether
+* there was one. Every successful claim is given back with parallelReleaseWorker().
+*/
+inline bool parallelClaimWorker()
+{
+    static const unsigned limit = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    std::atomic<unsigned>& workers = parallelWorkers();
+    unsigned live = workers.load(std::memory_order_relaxed);
+    while (live < limit)
+    {
+        if (workers.compare_exchange_weak(live, live + 1, std::memory_order_relaxed)) return true;
+    }
+    return false;
+}
+
+inline void parallelReleaseWorker()
+{
+    parallelWorkers().fetch_sub(1, std::memory_order_relaxed);
+}
+
+/**
+* Runs f and g, on two threads if fork is true and sequentially otherwise, and returns once
+* both are done. An exception thrown by f on the other thread is rethrown here. Forks are
+* capped process-wide at one live thread per hardware thread: past that, f runs inline too,
+* so deep or nested recursions never oversubscribe the cores.
+*/
+template <typename F, typename G>
+void parallelInvoke(bool fork, F f, G g)
+{
+    if (!fork || !parallelClaimWorker())
+    {
+        f();
+        g();
+        return;
+    }
+    std::exception_ptr error;
+    std::thread worker;
+    try
+    {
+        worker = std::thread([&]() {
+            try { f(); }
+            catch (...) { error = std::current_exception(); }
+        });
+    }
+    catch (...) // No thread to be had, so run both here after all
+    {
+        parallelReleaseWorker();
+        f();
+        g();
+        return;
+    }
+    try { g(); }
+    catch (...)
+    {
+        worker.join();
+        parallelReleaseWorker();
+        throw;
+    }
+    worker.join();
+    parallelReleaseWorker();
+    if (error) std::rethrow_exception(error);
+}
+
+/**
+* Sorts [first, last) stably, sorting the two halves on two threads for the top depth levels
+* and merging them back with std::inplace_merge(). The merges near the top are sequential,
+* so the speedup levels off once sorting the pieces costs less than merging them.
+*/
+template <typename RandomIt, typename Compare>
+void parallelStableSort(RandomIt first, RandomIt last, Compare comp, int depth)
+{
+    if (depth <= 0 || last - first < 4096)
+    {
+        std::stable_sort(first, last, comp);
+        return;
+    }
+    RandomIt middle = first + (last - first) / 2;
+    parallelInvoke(true,
+        [&]() { parallelStableSort(first, middle, comp, depth - 1); },
+        [&]() { parallelStableSort(middle, last, comp, depth - 1); });
+    std::inplace_merge(first, middle, last, comp);
+}
+
+#endif
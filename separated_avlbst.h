@@ -0,0 +1,297 @@
+#ifndef SEPARATED_AVLBST_H
+#define SEPARATED_AVLBST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+/**
+* A slab allocator for values, addressed by 32-bit handles. Values live in fixed-size
+* chunks that are never moved, so a handle (and a reference to its value) stays valid until
+* it is released. Released slots are reused before the slab grows.
+* Every live value must be released before the slab is destroyed.
+*/
+template <typename Value>
+class ValueSlab
+{
+public:
+    typedef uint32_t Handle;
+
+    ValueSlab();
+    ~ValueSlab();
+
+    Handle allocate(const Value& value);
+    void release(Handle handle);
+    Value& operator[](Handle handle) const;
+
+protected:
+    static const Handle kChunkBits = 8;
+    static const Handle kChunkSize = 1u << kChunkBits;
+
+    ValueSlab(const ValueSlab&);
+    ValueSlab& operator=(const ValueSlab&);
+
+    std::vector<Value*> chunks_; // Raw storage for kChunkSize values each
+    std::vector<Handle> free_; // Released handles
+    Handle next_; // First handle never handed out
+};
+
+/*
+  -------------------------------------------------
+  Begin implementations for the ValueSlab class.
+  -------------------------------------------------
+*/
+
+template<class Value>
+ValueSlab<Value>::ValueSlab() : next_(0)
+{
+}
+
+template<class Value>
+ValueSlab<Value>::~ValueSlab()
+{
+    for (size_t i = 0; i < chunks_.size(); i++) ::operator delete(chunks_[i]);
+}
+
+/**
+* Copies value into a free slot, reusing released slots first and adding a chunk when
+* every slot is taken.
+*/
+template<class Value>
+typename ValueSlab<Value>::Handle ValueSlab<Value>::allocate(const Value& value)
+{
+    Handle handle;
+    if (!free_.empty()) handle = free_.back();
+    else
+    {
+        handle = next_;
+        if ((handle >> kChunkBits) == chunks_.size())
+        {
+            chunks_.reserve(chunks_.size() + 1); // So push_back cannot throw after the allocation
+            chunks_.push_back(static_cast<Value*>(::operator new(sizeof(Value) * kChunkSize)));
+        }
+    }
+    new (&(*this)[handle]) Value(value); // If the copy throws, the slot is still free
+    if (!free_.empty()) free_.pop_back();
+    else next_++;
+    return handle;
+}
+
+template<class Value>
+void ValueSlab<Value>::release(Handle handle)
+{
+    (*this)[handle].~Value();
+    free_.push_back(handle);
+}
+
+template<class Value>
+Value& ValueSlab<Value>::operator[](Handle handle) const
+{
+    return chunks_[handle >> kChunkBits][handle & (kChunkSize - 1)];
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the ValueSlab class.
+  -----------------------------------------------
+*/
+
+/**
+* An AVL tree that keeps only keys, links and heights in its nodes. Values live out of line
+* in a ValueSlab and each node stores a 4-byte handle to its value, so lookups and
+* rotations only touch small, densely packed nodes however large Value is.
+* Iterators still yield (key, value) pairs, as references into the node and the slab.
+*/
+template <class Key, class Value>
+class SeparatedAVLTree : protected AVLTree<Key, typename ValueSlab<Value>::Handle>
+{
+public:
+    typedef typename ValueSlab<Value>::Handle Handle;
+    typedef AVLTree<Key, Handle> Base;
+
+    SeparatedAVLTree();
+    virtual ~SeparatedAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    using Base::empty;
+    using Base::size;
+    using Base::isBalanced;
+    using Base::defragment;
+
+    /**
+    * An iterator over the tree, wrapping the tree's own iterator. Dereferencing pairs the
+    * node's key with the value its handle refers to.
+    */
+    class iterator
+    {
+    public:
+        typedef std::pair<const Key&, Value&> reference;
+
+        // Lets it->second work even though operator* returns a temporary pair
+        struct pointer
+        {
+            reference item;
+            const reference* operator->() const { return &item; }
+        };
+
+        iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class SeparatedAVLTree<Key, Value>;
+        iterator(const typename Base::iterator& it, const ValueSlab<Value>* values);
+        typename Base::iterator it_;
+        const ValueSlab<Value>* values_;
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+
+protected:
+    ValueSlab<Value> values_;
+};
+
+/*
+  -----------------------------------------------------------
+  Begin implementations for the SeparatedAVLTree::iterator.
+  -----------------------------------------------------------
+*/
+
+template<class Key, class Value>
+SeparatedAVLTree<Key, Value>::iterator::iterator() : values_(NULL)
+{
+}
+
+template<class Key, class Value>
+SeparatedAVLTree<Key, Value>::iterator::iterator(const typename Base::iterator& it, const ValueSlab<Value>* values) :
+    it_(it), values_(values)
+{
+}
+
+template<class Key, class Value>
+typename SeparatedAVLTree<Key, Value>::iterator::reference SeparatedAVLTree<Key, Value>::iterator::operator*() const
+{
+    return reference(it_->first, (*values_)[it_->second]);
+}
+
+template<class Key, class Value>
+typename SeparatedAVLTree<Key, Value>::iterator::pointer SeparatedAVLTree<Key, Value>::iterator::operator->() const
+{
+    pointer result = { **this };
+    return result;
+}
+
+template<class Key, class Value>
+bool SeparatedAVLTree<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+    return it_ == rhs.it_;
+}
+
+template<class Key, class Value>
+bool SeparatedAVLTree<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+    return it_ != rhs.it_;
+}
+
+template<class Key, class Value>
+typename SeparatedAVLTree<Key, Value>::iterator& SeparatedAVLTree<Key, Value>::iterator::operator++()
+{
+    ++it_;
+    return *this;
+}
+
+/*
+  ---------------------------------------------------------
+  End implementations for the SeparatedAVLTree::iterator.
+  ---------------------------------------------------------
+*/
+
+template<class Key, class Value>
+SeparatedAVLTree<Key, Value>::SeparatedAVLTree()
+{
+}
+
+/**
+* Values must be released while the slab still exists, so the tree is emptied here rather
+* than by the base destructor.
+*/
+template<class Key, class Value>
+SeparatedAVLTree<Key, Value>::~SeparatedAVLTree()
+{
+    clear();
+}
+
+/**
+* Links a node holding a placeholder handle with one descent. Only if the key is new is the
+* value copied into the slab; otherwise the existing value is overwritten in place.
+*/
+template<class Key, class Value>
+void SeparatedAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    AVLNode<Key, Handle>* newNode = this->createNode(keyValuePair.first, 0, NULL);
+    AVLNode<Key, Handle>* node = this->linkNode(newNode);
+    if (node != newNode) // If same key, update value
+    {
+        delete newNode;
+        values_[node->getValue()] = keyValuePair.second;
+        return;
+    }
+    try
+    {
+        node->setValue(values_.allocate(keyValuePair.second));
+    }
+    catch (...)
+    {
+        delete this->unlinkNode(node);
+        throw;
+    }
+}
+
+template<class Key, class Value>
+void SeparatedAVLTree<Key, Value>::remove(const Key& key)
+{
+    AVLNode<Key, Handle>* node = static_cast<AVLNode<Key, Handle>*>(this->internalFind(key));
+    if (!node) return;
+    values_.release(node->getValue());
+    delete this->unlinkNode(node);
+}
+
+template<class Key, class Value>
+void SeparatedAVLTree<Key, Value>::clear()
+{
+    for (typename Base::iterator it = Base::begin(); it != Base::end(); ++it) values_.release(it->second);
+    Base::clear();
+}
+
+template<class Key, class Value>
+typename SeparatedAVLTree<Key, Value>::iterator SeparatedAVLTree<Key, Value>::begin() const
+{
+    return iterator(Base::begin(), &values_);
+}
+
+template<class Key, class Value>
+typename SeparatedAVLTree<Key, Value>::iterator SeparatedAVLTree<Key, Value>::end() const
+{
+    return iterator(Base::end(), &values_);
+}
+
+template<class Key, class Value>
+typename SeparatedAVLTree<Key, Value>::iterator SeparatedAVLTree<Key, Value>::find(const Key& key) const
+{
+    return iterator(Base::find(key), &values_);
+}
+
+#endif
@@ -0,0 +1,441 @@
+#ifndef SHARDED_AVLBST_H
+#define SHARDED_AVLBST_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+/**
+* A reader-writer lock split into stripes on separate cache lines. A reader takes only the
+* stripe picked by its thread, so readers on different threads do not all write the same
+* lock word; a writer takes every stripe, in order. Meets the SharedMutex requirements, so
+* it works with std::shared_lock and std::unique_lock.
+*/
+class StripedSharedMutex
+{
+public:
+    static const size_t kStripes = 16;
+
+    void lock()
+    {
+        for (size_t i = 0; i < kStripes; i++) stripes_[i].lock.lock();
+    }
+
+    void unlock()
+    {
+        for (size_t i = kStripes; i > 0; i--) stripes_[i - 1].lock.unlock();
+    }
+
+    void lock_shared() { stripes_[stripe()].lock.lock_shared(); }
+    void unlock_shared() { stripes_[stripe()].lock.unlock_shared(); }
+
+protected:
+    struct alignas(64) Stripe
+    {
+        std::shared_mutex lock;
+    };
+
+    static size_t stripe()
+    {
+        thread_local size_t index = std::hash<std::thread::id>()(std::this_thread::get_id()) % kStripes;
+        return index;
+    }
+
+    Stripe stripes_[kStripes];
+};
+
+/**
+* An ordered map made of several AVLTrees, each owning a contiguous range of keys and
+* guarded by its own lock, so writers to different ranges never touch the same nodes or
+* the same lock. Shard i owns the keys in [fences_[i - 1], fences_[i]).
+*
+* Shards that grow much larger than the average are rebalanced automatically: while there
+* are fewer than maxShards shards the big one is split in two, afterwards the boundaries of
+* all shards are moved to even them out. Both use AVLTree::split_at and AVLTree::concat, so
+* the trees themselves are cut and glued in O(log n); finding the new boundary keys takes
+* an in-order walk.
+*
+* insert(), remove(), get(), size() and for_each() are thread safe. Like the iterators of
+* AVLTree, iterators over the whole map (begin(), find(), lower_bound()) must not be used
+* while other threads are writing.
+*/
+template <class Key, class Value>
+class ShardedAVLMap
+{
+public:
+    explicit ShardedAVLMap(size_t maxShards);
+    ShardedAVLMap(size_t maxShards, const std::vector<Key>& fences);
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    bool get(const Key& key, Value& value) const;
+    size_t size() const;
+    size_t shardCount() const;
+    // Calls f on every item in key order, locking one shard at a time
+    template <typename F> void for_each(F f) const;
+    // Rebalances oversized shards, normally called automatically by insert()
+    void rebalance();
+
+    /**
+    * An iterator over every shard in key order.
+    */
+    class iterator
+    {
+    public:
+        iterator();
+
+        std::pair<const Key, Value>& operator*() const;
+        std::pair<const Key, Value>* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class ShardedAVLMap<Key, Value>;
+        iterator(const ShardedAVLMap<Key, Value>* map, size_t shard, typename AVLTree<Key, Value>::iterator current);
+        void skipEmptyShards();
+        const ShardedAVLMap<Key, Value>* map_;
+        size_t shard_;
+        typename AVLTree<Key, Value>::iterator current_;
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+
+protected:
+    // Aligned so the locks and trees of neighbouring shards do not share cache lines
+    struct alignas(64) Shard
+    {
+        Shard() : published(0), unchecked(0) {}
+        mutable std::mutex lock;
+        AVLTree<Key, Value> tree;
+        // tree.size() as of this shard's last check, for other shards' writers to read without
+        // taking lock. Only a heuristic, so it may lag behind
+        std::atomic<size_t> published;
+        size_t unchecked; // Inserts since the last check, guarded by lock
+    };
+
+    size_t shardFor(const Key& key) const;
+    bool oversized(size_t count, size_t total) const;
+    size_t publishedCount() const;
+    static Key keyAt(const Shard& shard, size_t index);
+    void redistribute(size_t total);
+
+    // A shard is only rebalanced once it holds at least this many keys
+    static const size_t kMinRebalanceSize = 1024;
+    // A shard compares its size with the others' once per this many inserts into it, so
+    // writers do not read every shard's cache line on every insert
+    static const size_t kCheckInterval = 64;
+
+    mutable StripedSharedMutex layoutLock_; // Shared by every operation, exclusive while shards are moved
+    std::vector<std::unique_ptr<Shard> > shards_;
+    std::vector<Key> fences_; // fences_[i] is the smallest key of shard i + 1
+    size_t maxShards_;
+};
+
+/*
+  ---------------------------------------------------
+  Begin implementations for the ShardedAVLMap::iterator.
+  ---------------------------------------------------
+*/
+
+template<class Key, class Value>
+ShardedAVLMap<Key, Value>::iterator::iterator() : map_(NULL), shard_(0)
+{
+}
+
+template<class Key, class Value>
+ShardedAVLMap<Key, Value>::iterator::iterator(const ShardedAVLMap<Key, Value>* map, size_t shard, typename AVLTree<Key, Value>::iterator current) :
+    map_(map), shard_(shard), current_(current)
+{
+    skipEmptyShards();
+}
+
+// Moves past the end of the current shard into the next non-empty one, or to end()
+template<class Key, class Value>
+void ShardedAVLMap<Key, Value>::iterator::skipEmptyShards()
+{
+    while (current_ == typename AVLTree<Key, Value>::iterator() && shard_ < map_->shards_.size())
+    {
+        shard_++;
+        if (shard_ < map_->shards_.size()) current_ = map_->shards_[shard_]->tree.begin();
+    }
+}
+
+template<class Key, class Value>
+std::pair<const Key, Value>& ShardedAVLMap<Key, Value>::iterator::operator*() const
+{
+    return *current_;
+}
+
+template<class Key, class Value>
+std::pair<const Key, Value>* ShardedAVLMap<Key, Value>::iterator::operator->() const
+{
+    return &(*current_);
+}
+
+template<class Key, class Value>
+bool ShardedAVLMap<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+    return shard_ == rhs.shard_ && current_ == rhs.current_;
+}
+
+template<class Key, class Value>
+bool ShardedAVLMap<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<class Key, class Value>
+typename ShardedAVLMap<Key, Value>::iterator& ShardedAVLMap<Key, Value>::iterator::operator++()
+{
+    ++current_;
+    skipEmptyShards();
+    return *this;
+}
+
+/*
+  -------------------------------------------------
+  End implementations for the ShardedAVLMap::iterator.
+  -------------------------------------------------
+*/
+
+/**
+* Starts with a single shard and splits it as keys arrive, up to maxShards shards.
+*/
+template<class Key, class Value>
+ShardedAVLMap<Key, Value>::ShardedAVLMap(size_t maxShards) : maxShards_(std::max<size_t>(maxShards, 1))
+{
+    shards_.push_back(std::unique_ptr<Shard>(new Shard()));
+}
+
+/**
+* Starts with one shard per range between the given (strictly increasing) fences, for
+* when the key distribution is known up front.
+*/
+template<class Key, class Value>
+ShardedAVLMap<Key, Value>::ShardedAVLMap(size_t maxShards, const std::vector<Key>& fences) :
+    fences_(fences), maxShards_(std::max(maxShards, fences.size() + 1))
+{
+    for (size_t i = 1; i < fences_.size(); i++)
+    {
+        if (!(fences_[i - 1] < fences_[i])) throw std::invalid_argument("ShardedAVLMap: fences must be strictly increasing");
+    }
+    for (size_t i = 0; i <= fences_.size(); i++) shards_.push_back(std::unique_ptr<Shard>(new Shard()));
+}
+
+// Binary search over the fences for the shard owning key
+template<class Key, class Value>
+size_t ShardedAVLMap<Key, Value>::shardFor(const Key& key) const
+{
+    return std::upper_bound(fences_.begin(), fences_.end(), key) - fences_.begin();
+}
+
+// The sum of the counts the shards last published, read without any shard's lock
+template<class Key, class Value>
+size_t ShardedAVLMap<Key, Value>::publishedCount() const
+{
+    size_t total = 0;
+    for (size_t i = 0; i < shards_.size(); i++) total += shards_[i]->published.load(std::memory_order_relaxed);
+    return total;
+}
+
+// A shard is oversized once it is more than twice as large as an even share of the keys
+template<class Key, class Value>
+bool ShardedAVLMap<Key, Value>::oversized(size_t count, size_t total) const
+{
+    return count >= kMinRebalanceSize && count > 2 * (total / maxShards_ + 1);
+}
+
+template<class Key, class Value>
+void ShardedAVLMap<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    bool needsRebalance;
+    {
+        std::shared_lock<StripedSharedMutex> layout(layoutLock_);
+        Shard& shard = *shards_[shardFor(keyValuePair.first)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.tree.insert(keyValuePair);
+        if (++shard.unchecked < kCheckInterval) return;
+        shard.unchecked = 0;
+        size_t count = shard.tree.size();
+        shard.published.store(count, std::memory_order_relaxed);
+        needsRebalance = oversized(count, publishedCount());
+    }
+    if (needsRebalance) rebalance();
+}
+
+template<class Key, class Value>
+void ShardedAVLMap<Key, Value>::remove(const Key& key)
+{
+    std::shared_lock<StripedSharedMutex> layout(layoutLock_);
+    Shard& shard = *shards_[shardFor(key)];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.tree.remove(key);
+}
+
+/**
+* Copies the value of key into value and returns true, or returns false if key is missing.
+*/
+template<class Key, class Value>
+bool ShardedAVLMap<Key, Value>::get(const Key& key, Value& value) const
+{
+    std::shared_lock<StripedSharedMutex> layout(layoutLock_);
+    const Shard& shard = *shards_[shardFor(key)];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    typename AVLTree<Key, Value>::iterator it = shard.tree.find(key);
+    if (it == shard.tree.end()) return false;
+    value = it->second;
+    return true;
+}
+
+template<class Key, class Value>
+size_t ShardedAVLMap<Key, Value>::size() const
+{
+    std::shared_lock<StripedSharedMutex> layout(layoutLock_);
+    size_t total = 0;
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+        std::lock_guard<std::mutex> guard(shards_[i]->lock);
+        total += shards_[i]->tree.size();
+    }
+    return total;
+}
+
+template<class Key, class Value>
+size_t ShardedAVLMap<Key, Value>::shardCount() const
+{
+    std::shared_lock<StripedSharedMutex> layout(layoutLock_);
+    return shards_.size();
+}
+
+template<class Key, class Value>
+template<typename F>
+void ShardedAVLMap<Key, Value>::for_each(F f) const
+{
+    std::shared_lock<StripedSharedMutex> layout(layoutLock_);
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+        std::lock_guard<std::mutex> guard(shards_[i]->lock);
+        for (typename AVLTree<Key, Value>::iterator it = shards_[i]->tree.begin(); it != shards_[i]->tree.end(); ++it) f(*it);
+    }
+}
+
+// Finds the key with the given rank in a shard, by walking that far in order
+template<class Key, class Value>
+Key ShardedAVLMap<Key, Value>::keyAt(const Shard& shard, size_t index)
+{
+    typename AVLTree<Key, Value>::iterator it = shard.tree.begin();
+    for (size_t i = 0; i < index; i++) ++it;
+    return it->first;
+}
+
+/**
+* Takes the layout lock exclusively (so no other operation is running) and fixes oversized
+* shards, judged by their exact sizes. While there is room for more shards an oversized shard is split at its median.
+* Once there are maxShards shards, all of them are concatenated and cut again at evenly
+* spaced ranks, which puts every shard back at the average size. A shard only becomes
+* oversized again after about an average shard's worth of inserts, so the O(n) walk to
+* find the new fences costs O(maxShards) per insert amortized.
+*/
+template<class Key, class Value>
+void ShardedAVLMap<Key, Value>::rebalance()
+{
+    std::unique_lock<StripedSharedMutex> layout(layoutLock_);
+    size_t total = 0;
+    for (size_t i = 0; i < shards_.size(); i++) total += shards_[i]->tree.size();
+    bool needsRedistribute = false;
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+        Shard& shard = *shards_[i];
+        size_t count = shard.tree.size();
+        shard.published.store(count, std::memory_order_relaxed);
+        if (!oversized(count, total)) continue;
+        if (shards_.size() < maxShards_) // Room for another shard, split this one at its median
+        {
+            size_t lowerCount = count / 2;
+            Key median = keyAt(shard, lowerCount);
+            std::unique_ptr<Shard> upper(new Shard());
+            upper->published.store(count - lowerCount, std::memory_order_relaxed);
+            shard.tree.split_at(median, upper->tree);
+            shard.published.store(lowerCount, std::memory_order_relaxed);
+            shards_.insert(shards_.begin() + i + 1, std::move(upper));
+            fences_.insert(fences_.begin() + i, median);
+            i++; // Both halves are now small enough
+        }
+        else needsRedistribute = true;
+    }
+    if (needsRedistribute) redistribute(total);
+}
+
+// Helper function for rebalance(): evens out every shard, the layout lock must be held exclusively
+template<class Key, class Value>
+void ShardedAVLMap<Key, Value>::redistribute(size_t total)
+{
+    size_t shardCount = shards_.size();
+    if (shardCount < 2 || total < shardCount) return;
+    AVLTree<Key, Value> all;
+    for (size_t i = 0; i < shardCount; i++) all.concat(shards_[i]->tree);
+    // One in-order walk collects the first key of every new shard
+    std::vector<Key> fences;
+    size_t rank = 0;
+    for (typename AVLTree<Key, Value>::iterator it = all.begin(); it != all.end() && fences.size() + 1 < shardCount; ++it, ++rank)
+    {
+        if (rank == total * (fences.size() + 1) / shardCount) fences.push_back(it->first);
+    }
+    // Cut from the top down, so the remainder of all is always the lowest part
+    for (size_t i = shardCount - 1; i > 0; i--)
+    {
+        all.split_at(fences[i - 1], shards_[i]->tree);
+        shards_[i]->published.store(total * (i + 1) / shardCount - total * i / shardCount, std::memory_order_relaxed);
+    }
+    shards_[0]->tree.concat(all);
+    shards_[0]->published.store(total / shardCount, std::memory_order_relaxed);
+    fences_ = fences;
+}
+
+template<class Key, class Value>
+typename ShardedAVLMap<Key, Value>::iterator ShardedAVLMap<Key, Value>::begin() const
+{
+    return iterator(this, 0, shards_[0]->tree.begin());
+}
+
+template<class Key, class Value>
+typename ShardedAVLMap<Key, Value>::iterator ShardedAVLMap<Key, Value>::end() const
+{
+    return iterator(this, shards_.size(), typename AVLTree<Key, Value>::iterator());
+}
+
+template<class Key, class Value>
+typename ShardedAVLMap<Key, Value>::iterator ShardedAVLMap<Key, Value>::find(const Key& key) const
+{
+    size_t shard = shardFor(key);
+    typename AVLTree<Key, Value>::iterator it = shards_[shard]->tree.find(key);
+    if (it == shards_[shard]->tree.end()) return end();
+    return iterator(this, shard, it);
+}
+
+/**
+* The first item not less than key. If the owning shard has none, the answer is the
+* first item of the next non-empty shard.
+*/
+template<class Key, class Value>
+typename ShardedAVLMap<Key, Value>::iterator ShardedAVLMap<Key, Value>::lower_bound(const Key& key) const
+{
+    size_t shard = shardFor(key);
+    return iterator(this, shard, shards_[shard]->tree.lower_bound(key));
+}
+
+#endif
@@ -0,0 +1,358 @@
+#ifndef STATIC_AVLBST_H
+#define STATIC_AVLBST_H
+
+#include <cstddef>
+#include <initializer_list>
+#include <stdexcept>
+#include <utility>
+
+/**
+* A fixed-capacity AVL tree whose insert, find and iteration are all constexpr, so a table
+* of literal pairs can be built by the compiler and placed in read-only data:
+*
+*   constexpr StaticAVLTree<std::string_view, int, 3> routes = {{"a", 1}, {"c", 3}, {"b", 2}};
+*   static_assert(routes.find("b")->second == 2);
+*
+* Nodes live in an array and link to each other by index, so no allocation happens and the
+* tree can be copied freely. The balancing is the usual AVL insert with rotations, written
+* recursively since there are no parent links. Inserting more than Capacity keys throws
+* std::length_error, which makes a constexpr build fail to compile.
+* Key and Value must be literal types that can be default constructed and assigned in
+* constant expressions (e.g. integers, enums, std::string_view, plain structs of those).
+*/
+template <class Key, class Value, size_t Capacity>
+class StaticAVLTree
+{
+public:
+    constexpr StaticAVLTree();
+    constexpr StaticAVLTree(std::initializer_list<std::pair<Key, Value> > items);
+
+    constexpr void insert(const Key& key, const Value& value);
+    constexpr void insert(const std::pair<Key, Value>& keyValuePair);
+    constexpr size_t size() const;
+    constexpr bool empty() const;
+    constexpr bool isBalanced() const;
+
+    /**
+    * An iterator over the tree in key order. Like the other trees without pair-shaped
+    * nodes, dereferencing yields a pair of references.
+    */
+    class iterator
+    {
+    public:
+        typedef std::pair<const Key&, const Value&> reference;
+
+        // Lets it->second work even though operator* returns a temporary pair
+        struct pointer
+        {
+            reference item;
+            constexpr const reference* operator->() const { return &item; }
+        };
+
+        constexpr iterator();
+
+        constexpr reference operator*() const;
+        constexpr pointer operator->() const;
+
+        constexpr bool operator==(const iterator& rhs) const;
+        constexpr bool operator!=(const iterator& rhs) const;
+
+        constexpr iterator& operator++();
+
+    protected:
+        friend class StaticAVLTree<Key, Value, Capacity>;
+        constexpr iterator(const StaticAVLTree<Key, Value, Capacity>* tree, int index);
+        const StaticAVLTree<Key, Value, Capacity>* tree_;
+        int index_;
+    };
+
+    constexpr iterator begin() const;
+    constexpr iterator end() const;
+    constexpr iterator find(const Key& key) const;
+    constexpr iterator lower_bound(const Key& key) const;
+
+protected:
+    static constexpr int kNull = -1;
+
+    struct StaticNode
+    {
+        constexpr StaticNode() : key(), value(), left(kNull), right(kNull), height(0) {}
+
+        Key key;
+        Value value;
+        int left;
+        int right;
+        int height;
+    };
+
+    constexpr int height(int node) const;
+    constexpr void updateHeight(int node);
+    constexpr int leftRotate(int node);
+    constexpr int rightRotate(int node);
+    constexpr int balance(int node);
+    constexpr int insertHelper(int node, const Key& key, const Value& value);
+    constexpr int successor(int node) const;
+    constexpr bool isBalancedHelper(int node) const;
+
+    StaticNode nodes_[Capacity];
+    int root_;
+    int count_;
+};
+
+/*
+  ------------------------------------------------------
+  Begin implementations for the StaticAVLTree::iterator.
+  ------------------------------------------------------
+*/
+
+template<class Key, class Value, size_t Capacity>
+constexpr StaticAVLTree<Key, Value, Capacity>::iterator::iterator() : tree_(NULL), index_(kNull)
+{
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr StaticAVLTree<Key, Value, Capacity>::iterator::iterator(const StaticAVLTree<Key, Value, Capacity>* tree, int index) :
+    tree_(tree), index_(index)
+{
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr typename StaticAVLTree<Key, Value, Capacity>::iterator::reference StaticAVLTree<Key, Value, Capacity>::iterator::operator*() const
+{
+    return reference(tree_->nodes_[index_].key, tree_->nodes_[index_].value);
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr typename StaticAVLTree<Key, Value, Capacity>::iterator::pointer StaticAVLTree<Key, Value, Capacity>::iterator::operator->() const
+{
+    return pointer{ **this };
+}
+
+// Every end() is equal, whichever tree it came from, like in BinarySearchTree
+template<class Key, class Value, size_t Capacity>
+constexpr bool StaticAVLTree<Key, Value, Capacity>::iterator::operator==(const iterator& rhs) const
+{
+    return index_ == rhs.index_ && (index_ == kNull || tree_ == rhs.tree_);
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr bool StaticAVLTree<Key, Value, Capacity>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr typename StaticAVLTree<Key, Value, Capacity>::iterator& StaticAVLTree<Key, Value, Capacity>::iterator::operator++()
+{
+    if (index_ != kNull) index_ = tree_->successor(index_);
+    return *this;
+}
+
+/*
+  ----------------------------------------------------
+  End implementations for the StaticAVLTree::iterator.
+  ----------------------------------------------------
+*/
+
+template<class Key, class Value, size_t Capacity>
+constexpr StaticAVLTree<Key, Value, Capacity>::StaticAVLTree() : nodes_(), root_(kNull), count_(0)
+{
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr StaticAVLTree<Key, Value, Capacity>::StaticAVLTree(std::initializer_list<std::pair<Key, Value> > items) :
+    nodes_(), root_(kNull), count_(0)
+{
+    for (const std::pair<Key, Value>& item : items) insert(item);
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr size_t StaticAVLTree<Key, Value, Capacity>::size() const
+{
+    return count_;
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr bool StaticAVLTree<Key, Value, Capacity>::empty() const
+{
+    return count_ == 0;
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr int StaticAVLTree<Key, Value, Capacity>::height(int node) const
+{
+    return node == kNull ? 0 : nodes_[node].height;
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr void StaticAVLTree<Key, Value, Capacity>::updateHeight(int node)
+{
+    int leftHeight = height(nodes_[node].left);
+    int rightHeight = height(nodes_[node].right);
+    nodes_[node].height = (leftHeight > rightHeight ? leftHeight : rightHeight) + 1;
+}
+
+// Rotations return the new root of the rotated subtree, which the caller links in its place
+template<class Key, class Value, size_t Capacity>
+constexpr int StaticAVLTree<Key, Value, Capacity>::leftRotate(int node)
+{
+    int rightChild = nodes_[node].right;
+    nodes_[node].right = nodes_[rightChild].left;
+    nodes_[rightChild].left = node;
+    updateHeight(node);
+    updateHeight(rightChild);
+    return rightChild;
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr int StaticAVLTree<Key, Value, Capacity>::rightRotate(int node)
+{
+    int leftChild = nodes_[node].left;
+    nodes_[node].left = nodes_[leftChild].right;
+    nodes_[leftChild].right = node;
+    updateHeight(node);
+    updateHeight(leftChild);
+    return leftChild;
+}
+
+/**
+* Restores the AVL property at node after one of its subtrees grew by one, with a single or
+* double rotation, and returns the root of the balanced subtree.
+*/
+template<class Key, class Value, size_t Capacity>
+constexpr int StaticAVLTree<Key, Value, Capacity>::balance(int node)
+{
+    updateHeight(node);
+    int bf = height(nodes_[node].left) - height(nodes_[node].right);
+    if (bf > 1)
+    {
+        int leftChild = nodes_[node].left;
+        if (height(nodes_[leftChild].left) < height(nodes_[leftChild].right)) nodes_[node].left = leftRotate(leftChild); // Left-right case
+        return rightRotate(node);
+    }
+    if (bf < -1)
+    {
+        int rightChild = nodes_[node].right;
+        if (height(nodes_[rightChild].right) < height(nodes_[rightChild].left)) nodes_[node].right = rightRotate(rightChild); // Right-left case
+        return leftRotate(node);
+    }
+    return node;
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr int StaticAVLTree<Key, Value, Capacity>::insertHelper(int node, const Key& key, const Value& value)
+{
+    if (node == kNull)
+    {
+        if (count_ == static_cast<int>(Capacity)) throw std::length_error("StaticAVLTree: capacity exceeded");
+        StaticNode& newNode = nodes_[count_];
+        newNode.key = key;
+        newNode.value = value;
+        newNode.left = kNull;
+        newNode.right = kNull;
+        newNode.height = 1;
+        return count_++;
+    }
+    if (key < nodes_[node].key) nodes_[node].left = insertHelper(nodes_[node].left, key, value);
+    else if (nodes_[node].key < key) nodes_[node].right = insertHelper(nodes_[node].right, key, value);
+    else // If same key, update value
+    {
+        nodes_[node].value = value;
+        return node;
+    }
+    return balance(node);
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr void StaticAVLTree<Key, Value, Capacity>::insert(const Key& key, const Value& value)
+{
+    root_ = insertHelper(root_, key, value);
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr void StaticAVLTree<Key, Value, Capacity>::insert(const std::pair<Key, Value>& keyValuePair)
+{
+    insert(keyValuePair.first, keyValuePair.second);
+}
+
+/**
+* Without parent links the successor is found from the root: the smallest key larger than
+* node's key. O(log n) per step, which is fine for the small tables this is meant for.
+*/
+template<class Key, class Value, size_t Capacity>
+constexpr int StaticAVLTree<Key, Value, Capacity>::successor(int node) const
+{
+    int best = kNull;
+    int current = root_;
+    while (current != kNull)
+    {
+        if (nodes_[node].key < nodes_[current].key)
+        {
+            best = current;
+            current = nodes_[current].left;
+        }
+        else current = nodes_[current].right;
+    }
+    return best;
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr typename StaticAVLTree<Key, Value, Capacity>::iterator StaticAVLTree<Key, Value, Capacity>::begin() const
+{
+    int node = root_;
+    while (node != kNull && nodes_[node].left != kNull) node = nodes_[node].left; // Go all the way left
+    return iterator(this, node);
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr typename StaticAVLTree<Key, Value, Capacity>::iterator StaticAVLTree<Key, Value, Capacity>::end() const
+{
+    return iterator(this, kNull);
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr typename StaticAVLTree<Key, Value, Capacity>::iterator StaticAVLTree<Key, Value, Capacity>::find(const Key& key) const
+{
+    int node = root_;
+    while (node != kNull)
+    {
+        if (key < nodes_[node].key) node = nodes_[node].left;
+        else if (nodes_[node].key < key) node = nodes_[node].right;
+        else return iterator(this, node);
+    }
+    return end();
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr typename StaticAVLTree<Key, Value, Capacity>::iterator StaticAVLTree<Key, Value, Capacity>::lower_bound(const Key& key) const
+{
+    int best = kNull;
+    int node = root_;
+    while (node != kNull)
+    {
+        if (nodes_[node].key < key) node = nodes_[node].right;
+        else
+        {
+            best = node;
+            node = nodes_[node].left;
+        }
+    }
+    return iterator(this, best);
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr bool StaticAVLTree<Key, Value, Capacity>::isBalancedHelper(int node) const
+{
+    if (node == kNull) return true;
+    int bf = height(nodes_[node].left) - height(nodes_[node].right);
+    if (bf < -1 || bf > 1) return false;
+    return isBalancedHelper(nodes_[node].left) && isBalancedHelper(nodes_[node].right);
+}
+
+template<class Key, class Value, size_t Capacity>
+constexpr bool StaticAVLTree<Key, Value, Capacity>::isBalanced() const
+{
+    return isBalancedHelper(root_);
+}
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef STRING_AVLBST_H
+#define STRING_AVLBST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include "avlbst.h"
+
+/**
+* A key prefix of Words 64-bit words: the first 8 * Words bytes of a key, zero padded and
+* packed big-endian, so comparing the words in turn as integers orders keys the same way
+* std::string does (bytes compared as unsigned char).
+*/
+template <int Words>
+struct StringPrefix
+{
+    static const size_t kBytes = 8 * Words;
+
+    explicit StringPrefix(const std::string& key);
+
+    // Negative, zero or positive as this prefix orders before, equal to or after other
+    int compare(const StringPrefix<Words>& other) const;
+
+    uint64_t words[Words];
+};
+
+template<int Words>
+StringPrefix<Words>::StringPrefix(const std::string& key)
+{
+    size_t count = key.size() < kBytes ? key.size() : kBytes;
+    for (int i = 0; i < Words; i++) words[i] = 0;
+    for (size_t i = 0; i < count; i++) words[i / 8] |= static_cast<uint64_t>(static_cast<unsigned char>(key[i])) << (56 - 8 * (i % 8));
+}
+
+template<int Words>
+int StringPrefix<Words>::compare(const StringPrefix<Words>& other) const
+{
+    for (int i = 0; i < Words; i++)
+    {
+        if (words[i] != other.words[i]) return words[i] < other.words[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+* An AVL node with a std::string key that also keeps a prefix of the key and its length.
+* Most comparisons in a search are decided by the prefix and never touch the key's
+* characters, which for keys too long for the small string buffer live in a separate heap
+* block.
+*/
+template <typename Value, int Words = 1>
+class StringAVLNode : public AVLNode<std::string, Value>
+{
+public:
+    typedef StringPrefix<Words> Prefix;
+    static const size_t kPrefixBytes = Prefix::kBytes;
+
+    StringAVLNode(const std::string& key, const Value& value, StringAVLNode<Value, Words>* parent);
+    StringAVLNode(StringAVLNode<Value, Words>&& other);
+    virtual ~StringAVLNode();
+
+    // Getters for the cached prefix and length
+    const Prefix& getPrefix() const;
+    uint32_t getLength() const;
+
+    // The cached length, capped since only lengths up to kPrefixBytes are ever read from it
+    static uint32_t lengthOf(const std::string& key);
+
+    // Same reason as in AVLNode, these return the more specific node type
+    virtual StringAVLNode<Value, Words>* getParent() const override;
+    virtual StringAVLNode<Value, Words>* getLeft() const override;
+    virtual StringAVLNode<Value, Words>* getRight() const override;
+
+protected:
+    uint32_t length_; // Declared first, so it can go into AVLNode's tail padding
+    Prefix prefix_;
+};
+
+/*
+  ---------------------------------------------------
+  Begin implementations for the StringAVLNode class.
+  ---------------------------------------------------
+*/
+
+template<class Value, int Words>
+StringAVLNode<Value, Words>::StringAVLNode(const std::string& key, const Value& value, StringAVLNode<Value, Words>* parent) :
+    AVLNode<std::string, Value>(key, value, parent), length_(lengthOf(key)), prefix_(key)
+{
+
+}
+
+template<class Value, int Words>
+StringAVLNode<Value, Words>::StringAVLNode(StringAVLNode<Value, Words>&& other) :
+    AVLNode<std::string, Value>(std::move(other)), length_(other.length_), prefix_(other.prefix_)
+{
+
+}
+
+template<class Value, int Words>
+StringAVLNode<Value, Words>::~StringAVLNode()
+{
+
+}
+
+template<class Value, int Words>
+const typename StringAVLNode<Value, Words>::Prefix& StringAVLNode<Value, Words>::getPrefix() const
+{
+    return prefix_;
+}
+
+template<class Value, int Words>
+uint32_t StringAVLNode<Value, Words>::getLength() const
+{
+    return length_;
+}
+
+template<class Value, int Words>
+uint32_t StringAVLNode<Value, Words>::lengthOf(const std::string& key)
+{
+    return key.size() < std::numeric_limits<uint32_t>::max() ? static_cast<uint32_t>(key.size()) : std::numeric_limits<uint32_t>::max();
+}
+
+template<class Value, int Words>
+StringAVLNode<Value, Words>* StringAVLNode<Value, Words>::getParent() const
+{
+    return static_cast<StringAVLNode<Value, Words>*>(this->parent_);
+}
+
+template<class Value, int Words>
+StringAVLNode<Value, Words>* StringAVLNode<Value, Words>::getLeft() const
+{
+    return static_cast<StringAVLNode<Value, Words>*>(this->left_);
+}
+
+template<class Value, int Words>
+StringAVLNode<Value, Words>* StringAVLNode<Value, Words>::getRight() const
+{
+    return static_cast<StringAVLNode<Value, Words>*>(this->right_);
+}
+
+/*
+  -------------------------------------------------
+  End implementations for the StringAVLNode class.
+  -------------------------------------------------
+*/
+
+/**
+* An AVL tree keyed by std::string whose searches compare cached key prefixes first. A
+* comparison reads the key's characters only when the first 8 * PrefixWords bytes of both
+* keys are equal and both are longer than that, so searches among keys that differ early
+* cost one cache miss per level instead of two. Keys that share a long common start, like
+* URLs, want a longer prefix; each extra word adds 8 bytes to every node. Short keys already
+* sit inside the node, in std::string's small buffer, so no separate inline storage is kept.
+* find(), lower_bound(), insert() and remove() use the prefixes; everything else is the
+* plain AVLTree, and stays correct since the prefixes only speed up comparisons.
+*/
+template <class Value, int PrefixWords = 1, class Balance = AVLBalance>
+class StringAVLTree : public AVLTree<std::string, Value, Balance>
+{
+public:
+    typedef AVLTree<std::string, Value, Balance> Base;
+    typedef typename Base::iterator iterator;
+    typedef StringAVLNode<Value, PrefixWords> SNode;
+    typedef typename SNode::Prefix Prefix;
+
+    virtual void insert(const std::pair<const std::string, Value>& new_item) override;
+    virtual void remove(const std::string& key) override;
+    using Base::insert;
+    iterator find(const std::string& key) const;
+    iterator lower_bound(const std::string& key) const;
+
+protected:
+    virtual AVLNode<std::string, Value>* createNode(const std::string& key, const Value& value, AVLNode<std::string, Value>* parent) override;
+    virtual AVLNode<std::string, Value>* relocateNode(AVLNode<std::string, Value>* node) override;
+
+    // Like std::string::compare() of key with the node's key, given key's prefix and length
+    static int compare(const Prefix& prefix, const std::string& key, const SNode* node);
+    // Descends to key; returns its node, or NULL with parent (and the side it would go on) set
+    SNode* search(const std::string& key, SNode*& parent, bool& right) const;
+};
+
+template<class Value, int PrefixWords, class Balance>
+AVLNode<std::string, Value>* StringAVLTree<Value, PrefixWords, Balance>::createNode(const std::string& key, const Value& value, AVLNode<std::string, Value>* parent)
+{
+    return new SNode(key, value, static_cast<SNode*>(parent));
+}
+
+// Lets defragment() move nodes, the moved node carries the cached prefix along
+template<class Value, int PrefixWords, class Balance>
+AVLNode<std::string, Value>* StringAVLTree<Value, PrefixWords, Balance>::relocateNode(AVLNode<std::string, Value>* node)
+{
+    void* memory = this->relocationMemory(sizeof(SNode), alignof(SNode));
+    if (!memory) return NULL;
+    return new (memory) SNode(std::move(*static_cast<SNode*>(node)));
+}
+
+/**
+* Different prefixes decide the order by themselves. Equal prefixes with either key no
+* longer than the prefix mean that key is a prefix of the other one, so the lengths decide.
+* Only two long keys with equal prefixes need their remaining characters compared.
+*/
+template<class Value, int PrefixWords, class Balance>
+int StringAVLTree<Value, PrefixWords, Balance>::compare(const Prefix& prefix, const std::string& key, const SNode* node)
+{
+    int result = prefix.compare(node->getPrefix());
+    if (result) return result;
+    size_t length = key.size();
+    size_t nodeLength = node->getLength();
+    if (length <= SNode::kPrefixBytes || nodeLength <= SNode::kPrefixBytes)
+    {
+        return length < nodeLength ? -1 : (nodeLength < length ? 1 : 0);
+    }
+    const std::string& nodeKey = node->getKey();
+    nodeLength = nodeKey.size(); // The cached length is capped
+    size_t common = (length < nodeLength ? length : nodeLength) - SNode::kPrefixBytes;
+    result = std::memcmp(key.data() + SNode::kPrefixBytes, nodeKey.data() + SNode::kPrefixBytes, common);
+    if (result) return result;
+    return length < nodeLength ? -1 : (nodeLength < length ? 1 : 0);
+}
+
+template<class Value, int PrefixWords, class Balance>
+typename StringAVLTree<Value, PrefixWords, Balance>::SNode* StringAVLTree<Value, PrefixWords, Balance>::search(const std::string& key, SNode*& parent, bool& right) const
+{
+    Prefix prefix(key);
+    SNode* node = static_cast<SNode*>(this->root_);
+    parent = NULL;
+    right = false;
+    while (node)
+    {
+        int result = compare(prefix, key, node);
+        if (result == 0) return node;
+        parent = node;
+        right = result > 0;
+        node = right ? node->getRight() : node->getLeft();
+    }
+    return NULL;
+}
+
+/**
+* The same insert as AVLTree::insert(), with the descent done by search(). Bulk mode has its
+* own placement rules, so it is left to the base version.
+*/
+template<class Value, int PrefixWords, class Balance>
+void StringAVLTree<Value, PrefixWords, Balance>::insert(const std::pair<const std::string, Value>& new_item)
+{
+    if (this->bulk_)
+    {
+        Base::insert(new_item);
+        return;
+    }
+    AVL_LATENCY_SCOPE(kInsert, this->size_); // After the bulk case, which Base::insert() times itself
+    SNode* parent;
+    bool right;
+    SNode* node = search(new_item.first, parent, right);
+    if (node) // If same key, update value
+    {
+        node->setValue(new_item.second);
+        this->valueUpdated(node);
+        return;
+    }
+    AVLNode<std::string, Value>* newNode = createNode(new_item.first, new_item.second, parent);
+    if (!parent) this->root_ = newNode;
+    else if (right) parent->setRight(newNode);
+    else parent->setLeft(newNode);
+    this->nodeLinked(newNode);
+    if (parent) this->rebalanceAfterInsert(parent);
+}
+
+template<class Value, int PrefixWords, class Balance>
+void StringAVLTree<Value, PrefixWords, Balance>::remove(const std::string& key)
+{
+    AVL_LATENCY_SCOPE(kRemove, this->size_);
+    SNode* parent;
+    bool right;
+    SNode* node = search(key, parent, right);
+    if (node) delete this->unlinkNode(node);
+}
+
+template<class Value, int PrefixWords, class Balance>
+typename StringAVLTree<Value, PrefixWords, Balance>::iterator StringAVLTree<Value, PrefixWords, Balance>::find(const std::string& key) const
+{
+    SNode* parent;
+    bool right;
+    SNode* node = search(key, parent, right);
+    return node ? this->makeIterator(node) : this->end();
+}
+
+template<class Value, int PrefixWords, class Balance>
+typename StringAVLTree<Value, PrefixWords, Balance>::iterator StringAVLTree<Value, PrefixWords, Balance>::lower_bound(const std::string& key) const
+{
+    Prefix prefix(key);
+    SNode* node = static_cast<SNode*>(this->root_);
+    SNode* best = NULL;
+    while (node)
+    {
+        if (compare(prefix, key, node) > 0) node = node->getRight(); // node and its left subtree are too small
+        else
+        {
+            best = node; // Candidate, but there may be a smaller one on the left
+            node = node->getLeft();
+        }
+    }
+    return best ? this->makeIterator(best) : this->end();
+}
+
+#endif
@@ -0,0 +1,62 @@
+#include <vector>
+#include "test_util.h"
+
+// insert_batch() and remove_batch() against the same keys applied one at a time
+static void checkBatches(unsigned threads, unsigned seed)
+{
+    CheckedAVLTree<int, int> batched;
+    CheckedAVLTree<int, int> sequential;
+    std::map<int, int> expected;
+    std::srand(seed);
+    for (int round = 0; round < 200; round++)
+    {
+        int count = std::rand() % (round % 10 == 0 ? 5000 : 100);
+        std::vector<std::pair<int, int> > items;
+        std::vector<int> keys;
+        for (int i = 0; i < count; i++)
+        {
+            int key = std::rand() % 20000;
+            items.push_back(std::make_pair(key, std::rand()));
+            keys.push_back(key);
+        }
+        if (std::rand() % 3)
+        {
+            batched.insert_batch(items.begin(), items.end(), threads);
+            for (size_t i = 0; i < items.size(); i++)
+            {
+                sequential.insert(items[i]);
+                expected[items[i].first] = items[i].second; // Later duplicates win, as with insert()
+            }
+        }
+        else
+        {
+            batched.remove_batch(keys.begin(), keys.end(), threads);
+            for (size_t i = 0; i < keys.size(); i++)
+            {
+                sequential.remove(keys[i]);
+                expected.erase(keys[i]);
+            }
+        }
+        batched.checkShape();
+        CHECK(batched.isBalanced());
+        checkSame(batched, expected);
+        checkSame(sequential, expected);
+    }
+}
+
+int main()
+{
+    checkBatches(1, 1);
+    checkBatches(4, 2);
+    checkBatches(0, 3);
+
+    // A batch into an empty tree, and an empty batch
+    CheckedAVLTree<int, int> tree;
+    std::vector<std::pair<int, int> > items;
+    for (int i = 0; i < 1000; i++) items.push_back(std::make_pair(999 - i, i));
+    tree.insert_batch(items.begin(), items.end());
+    tree.insert_batch(items.end(), items.end());
+    tree.checkShape();
+    CHECK(tree.size() == 1000 && tree.begin()->first == 0);
+    return 0;
+}
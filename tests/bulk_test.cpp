@@ -0,0 +1,85 @@
+#include <vector>
+#include "aggregate_avlbst.h"
+#include "interval_avlbst.h"
+#include "merkle_avlbst.h"
+#include "test_util.h"
+
+// Lookups, iteration and the cached ends and size while a plain tree is in bulk mode
+static void checkPlainTree()
+{
+    std::srand(5);
+    CheckedAVLTree<int, int> tree;
+    std::map<int, int> expected;
+    tree.begin_bulk();
+    for (int i = 0; i < 20000; i++)
+    {
+        int key = i % 3 ? i : std::rand() % 20000; // Mostly ascending, as bulk loads tend to be
+        if (std::rand() % 5)
+        {
+            tree.insert(std::make_pair(key, i));
+            expected[key] = i;
+        }
+        else
+        {
+            tree.remove(key);
+            expected.erase(key);
+        }
+        if (i % 1000 == 999)
+        {
+            checkSame(tree, expected);
+            CHECK(tree.min()->first == expected.begin()->first);
+            CHECK(tree.max()->first == expected.rbegin()->first);
+            for (int probe = 0; probe < 100; probe++)
+            {
+                int k = std::rand() % 20000;
+                CHECK((tree.find(k) != tree.end()) == (expected.count(k) > 0));
+            }
+        }
+    }
+    tree.end_bulk();
+    tree.checkShape();
+    checkSame(tree, expected);
+}
+
+// Trees with per-subtree data answer their queries exactly during a bulk load
+static void checkSubtreeData()
+{
+    AggregateAVLTree<int, int, SumAggregate<int> > sums;
+    sums.begin_bulk();
+    for (int i = 0; i < 100; i++)
+    {
+        sums.insert(std::make_pair(i, 1));
+        CHECK(sums.aggregate() == i + 1);
+    }
+    CHECK(sums.aggregate(10, 19) == 10);
+    sums.remove(50);
+    CHECK(sums.aggregate() == 99);
+    sums.end_bulk();
+    CHECK(sums.aggregate() == 99 && sums.isBalanced());
+
+    IntervalTree<int, int> intervals;
+    intervals.begin_bulk();
+    for (int i = 0; i < 100; i++) intervals.insert(i * 10, i * 10 + 5, i);
+    CHECK(intervals.stab(503).size() == 1 && intervals.stab(507).empty());
+    CHECK(intervals.overlapping(0, 995).size() == 100);
+    intervals.end_bulk();
+
+    MerkleAVLTree<int, int> bulk;
+    MerkleAVLTree<int, int> normal;
+    bulk.begin_bulk();
+    for (int i = 0; i < 1000; i++)
+    {
+        bulk.insert(std::make_pair(i, i * i));
+        normal.insert(std::make_pair(i, i * i));
+    }
+    CHECK(bulk.digest() == normal.digest());
+    bulk.end_bulk();
+    CHECK(bulk.digest() == normal.digest());
+}
+
+int main()
+{
+    checkPlainTree();
+    checkSubtreeData();
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapped_avlbst.h"
+#include "test_util.h"
+
+static void checkContents(MappedAVLTree<int, int>& tree, const std::map<int, int>& expected)
+{
+    CHECK(tree.size() == expected.size());
+    std::map<int, int>::const_iterator want = expected.begin();
+    for (MappedAVLTree<int, int>::iterator it = tree.begin(); it != tree.end(); ++it, ++want)
+    {
+        CHECK(want != expected.end());
+        CHECK((*it).first == want->first && (*it).second == want->second);
+    }
+    CHECK(want == expected.end());
+}
+
+static off_t fileSize(const std::string& file)
+{
+    struct stat st;
+    CHECK(::stat(file.c_str(), &st) == 0);
+    return st.st_size;
+}
+
+// Contents survive closing and reopening, across several grow() calls
+static void checkReopen(const std::string& path, std::map<int, int>& expected)
+{
+    std::srand(7);
+    {
+        MappedAVLTree<int, int> tree(path, 4096);
+        for (int i = 0; i < 5000; i++)
+        {
+            int key = std::rand() % 8000;
+            if (std::rand() % 4)
+            {
+                tree.insert(std::make_pair(key, i));
+                expected[key] = i;
+            }
+            else
+            {
+                tree.remove(key);
+                expected.erase(key);
+            }
+        }
+        checkContents(tree, expected);
+        tree.sync();
+    }
+    CHECK(fileSize(path) > 4096);
+    MappedAVLTree<int, int> tree(path);
+    checkContents(tree, expected);
+    for (int probe = 0; probe < 1000; probe++)
+    {
+        int key = std::rand() % 8000;
+        CHECK((tree.find(key) != tree.end()) == (expected.count(key) > 0));
+    }
+}
+
+// A file longer than its header says, as a crash inside grow() leaves it, opens and keeps growing
+static void checkInterruptedGrow(const std::string& path, std::map<int, int>& expected)
+{
+    off_t size = fileSize(path);
+    CHECK(::truncate(path.c_str(), size * 2) == 0);
+    {
+        MappedAVLTree<int, int> tree(path);
+        checkContents(tree, expected);
+        for (int i = 0; i < 20000; i++)
+        {
+            tree.insert(std::make_pair(10000 + i, i));
+            expected[10000 + i] = i;
+        }
+        tree.sync();
+    }
+    MappedAVLTree<int, int> tree(path);
+    checkContents(tree, expected);
+
+    // A file shorter than its header says lost data, so it is refused
+    CHECK(::truncate(path.c_str(), fileSize(path) - 4096) == 0);
+    bool refused = false;
+    try
+    {
+        MappedAVLTree<int, int> truncated(path);
+    }
+    catch (const std::runtime_error&)
+    {
+        refused = true;
+    }
+    CHECK(refused);
+}
+
+int main()
+{
+    char directory[] = "/tmp/mapped_testXXXXXX";
+    CHECK(::mkdtemp(directory) != NULL);
+    std::string path = std::string(directory) + "/tree";
+    std::map<int, int> expected;
+    checkReopen(path, expected);
+    checkInterruptedGrow(path, expected);
+    ::unlink(path.c_str());
+    ::rmdir(directory);
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <string>
+#include "aggregate_avlbst.h"
+#include "string_avlbst.h"
+#include "test_util.h"
+
+// extract(), insert(node_type&&) and merge() against std::map
+static void checkMoves()
+{
+    std::srand(6);
+    CheckedAVLTree<int, int> tree;
+    CheckedAVLTree<int, int> other;
+    std::map<int, int> expected;
+    std::map<int, int> expectedOther;
+    for (int i = 0; i < 2000; i++)
+    {
+        int key = std::rand() % 5000;
+        tree.insert(std::make_pair(key, i));
+        expected[key] = i;
+    }
+    for (int round = 0; round < 2000; round++)
+    {
+        int key = std::rand() % 5000;
+        CheckedAVLTree<int, int>::node_type handle = tree.extract(key);
+        CHECK(handle.empty() == (expected.count(key) == 0));
+        if (handle.empty()) continue;
+        CHECK(handle.key() == key && handle.mapped() == expected[key]);
+        handle.mapped() = -round;
+        expected.erase(key);
+        CheckedAVLTree<int, int>::iterator it = other.insert(std::move(handle));
+        if (expectedOther.count(key)) CHECK(!handle.empty()); // Key taken, the handle keeps its node
+        else
+        {
+            CHECK(handle.empty() && it->first == key && it->second == -round);
+            expectedOther[key] = -round;
+        }
+    }
+    tree.checkShape();
+    other.checkShape();
+    checkSame(tree, expected);
+    checkSame(other, expectedOther);
+
+    // Entries whose keys are in both trees stay behind in other
+    tree.merge(other);
+    for (std::map<int, int>::iterator it = expectedOther.begin(); it != expectedOther.end();)
+    {
+        if (expected.insert(*it).second) expectedOther.erase(it++);
+        else ++it;
+    }
+    tree.checkShape();
+    other.checkShape();
+    checkSame(tree, expected);
+    checkSame(other, expectedOther);
+}
+
+// Re-keying goes through insert(node_type&&, const Key&), which leaves the key of an existing node alone
+static void checkRekey()
+{
+    CheckedAVLTree<int, int> tree;
+    std::map<int, int> expected;
+    for (int i = 0; i < 1000; i++)
+    {
+        tree.insert(std::make_pair(i, i));
+        expected[i] = i;
+    }
+    for (int i = 0; i < 1000; i += 2)
+    {
+        CheckedAVLTree<int, int>::iterator it = tree.insert(tree.extract(i), i + 5000);
+        CHECK(it->first == i + 5000 && it->second == i);
+        expected.erase(i);
+        expected[i + 5000] = i;
+    }
+    CheckedAVLTree<int, int>::node_type handle = tree.extract(1);
+    CHECK(tree.insert(std::move(handle), 3)->second == 3);
+    CHECK(!handle.empty() && handle.key() == 1);
+    CHECK(tree.insert(std::move(handle), 1)->second == 1 && handle.empty());
+    tree.checkShape();
+    checkSame(tree, expected);
+
+    // The aggregate follows changes made through mapped() and the new key
+    AggregateAVLTree<int, int, SumAggregate<int> > sums;
+    for (int i = 0; i < 100; i++) sums.insert(std::make_pair(i, 1));
+    AggregateAVLTree<int, int, SumAggregate<int> >::node_type moved = sums.extract(10);
+    moved.mapped() = 50;
+    sums.insert(std::move(moved), 200);
+    CHECK(sums.aggregate() == 149 && sums.aggregate(0, 99) == 99 && sums.aggregate(100, 300) == 50);
+
+    // The string tree's cached prefix comes from the new key
+    StringAVLTree<int> strings;
+    strings.insert(std::make_pair(std::string("apple"), 1));
+    strings.insert(std::make_pair(std::string("banana"), 2));
+    strings.insert(strings.extract("apple"), "cherry");
+    CHECK(strings.find("apple") == strings.end());
+    CHECK(strings.find("cherry") != strings.end() && strings.find("cherry")->second == 1);
+    CHECK(strings.size() == 2);
+}
+
+int main()
+{
+    checkMoves();
+    checkRekey();
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include "test_util.h"
+
+// split_at() and concat() against std::map, checking both halves after every cut
+int main()
+{
+    std::srand(4);
+    CheckedAVLTree<int, int> tree;
+    std::map<int, int> expected;
+    for (int i = 0; i < 3000; i++)
+    {
+        int key = std::rand() % 10000;
+        tree.insert(std::make_pair(key, i));
+        expected[key] = i;
+    }
+    for (int round = 0; round < 300; round++)
+    {
+        int key = std::rand() % 11000 - 500;
+        CheckedAVLTree<int, int> upper;
+        tree.split_at(key, upper);
+        std::map<int, int> expectedUpper(expected.lower_bound(key), expected.end());
+        expected.erase(expected.lower_bound(key), expected.end());
+        tree.checkShape();
+        upper.checkShape();
+        checkSame(tree, expected);
+        checkSame(upper, expectedUpper);
+        if (!upper.empty()) CHECK(upper.min()->first >= key);
+        if (!tree.empty()) CHECK(tree.max()->first < key);
+
+        // Glue the halves back together, from either side
+        if (round % 2) tree.concat(upper);
+        else
+        {
+            upper.concat(tree); // other may hold the lower keys as well
+            CHECK(tree.empty());
+            tree.concat(upper);
+        }
+        CHECK(upper.empty() && upper.size() == 0);
+        expected.insert(expectedUpper.begin(), expectedUpper.end());
+        tree.checkShape();
+        checkSame(tree, expected);
+    }
+
+    // Joining trees of very different heights
+    CheckedAVLTree<int, int> small;
+    CheckedAVLTree<int, int> large;
+    small.insert(std::make_pair(-1, -1));
+    for (int i = 0; i < 10000; i++) large.insert(std::make_pair(i, i));
+    small.concat(large);
+    small.checkShape();
+    CHECK(small.size() == 10001 && small.min()->first == -1 && small.max()->first == 9999);
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include "avlbst.h"
+
+// Like assert(), but also checked with NDEBUG, and reports the failed condition
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            std::exit(1); \
+        } \
+    } while (0)
+
+/**
+* An AVLTree that can check its own shape: parent links, key order, stored heights and the
+* AVL balance condition at every node.
+*/
+template <class Key, class Value>
+class CheckedAVLTree : public AVLTree<Key, Value>
+{
+public:
+    void checkShape() const
+    {
+        checkSubtree(static_cast<AVLNode<Key, Value>*>(this->root_), NULL);
+    }
+
+protected:
+    // Returns the height of the subtree
+    static int checkSubtree(const AVLNode<Key, Value>* node, const AVLNode<Key, Value>* parent)
+    {
+        if (!node) return 0;
+        CHECK(node->getParent() == parent);
+        if (node->getLeft()) CHECK(node->getLeft()->getKey() < node->getKey());
+        if (node->getRight()) CHECK(node->getKey() < node->getRight()->getKey());
+        int left = checkSubtree(node->getLeft(), node);
+        int right = checkSubtree(node->getRight(), node);
+        CHECK(left - right <= 1 && right - left <= 1);
+        int height = (left > right ? left : right) + 1;
+        CHECK(node->getHeight() == height);
+        return height;
+    }
+};
+
+// Checks that iterating tree gives exactly the entries of expected, in order
+template <class Tree, class Key, class Value>
+void checkSame(const Tree& tree, const std::map<Key, Value>& expected)
+{
+    CHECK(tree.size() == expected.size());
+    typename std::map<Key, Value>::const_iterator it = expected.begin();
+    for (typename Tree::iterator node = tree.begin(); node != tree.end(); ++node, ++it)
+    {
+        CHECK(it != expected.end());
+        CHECK(node->first == it->first && node->second == it->second);
+    }
+    CHECK(it == expected.end());
+}
+
+#endif